@@ -35,8 +35,57 @@
  *                                  # is bound or whenever the 'file' property is written in sysfs
  *                                  # (see below). If autoload is '0' then you must explicitly write
  *                                  # to the 'program' property in sysfs (see below).
+ *                                  # "if-unconfigured" skips the load at boot if the FPGA is
+ *                                  # configured already (see below).
+ *      async      = 1;             # optional; when nonzero then programming triggered from sysfs
+ *                                  # is executed asynchronously (see 'async' below).
+ *      skip-identical = 1;         # optional; do not reprogram if the image is identical to the one
+ *                                  # that is currently loaded (see 'skip_identical' below).
+ *      partial-fpga-config;        # optional; 'file' is a partial image (see 'flags' below).
+ *      expected-part = "7z020";    # optional; reject .bit files for other parts (see 'expected_part').
+ *      bit-swap   = 1;             # optional; byte-swap the payload of .bit files (see 'bit_swap').
+ *      loader     = "pages";       # optional; how images are read (see 'loader').
+ *      priority   = 10;            # optional; scheduling priority of loads (see 'priority').
+ *      partial-image-names = "fft", "fir";          # optional; named set of partial images
+ *      partial-images      = "fft.bin", "fir.bin";  # (see 'partial_images' below).
+ *      fabric-devices = <&fabric>;  # optional; devices implemented by the fabric (see below); alternatively
+ *                                   # a child node named 'fabric'.
+ *      memory-region = <&fpga_image>; # optional; image preloaded by the bootloader (see below).
+ *      image-size = <0x3dbafc>;     # optional; size of the image in 'memory-region'.
+ *      memory-region-release;       # optional; free 'memory-region' once loaded (built-in only).
  *  };
  *
+ * The children of the 'fabric' node (or of the node referenced by 'fabric-devices')
+ * describe devices implemented by the FPGA fabric. They are created (of_platform_populate)
+ * after an image has been loaded successfully and removed before the FPGA is reprogrammed
+ * (or the programmer is unbound), so that their drivers bind as soon as the fabric is up
+ * and unbind before it goes away. Partial images leave these devices alone.
+ * Children which are buses ('simple-bus' etc.) are populated recursively. A node
+ * referenced by 'fabric-devices' must not itself be 'simple-bus' compatible; the
+ * kernel would otherwise create its devices at boot, before the fabric is
+ * configured.
+ *
+ * For the fastest cold start the bootloader may preload the image into a reserved-memory
+ * region which is referenced by 'memory-region' (it must not be 'no-map'):
+ *
+ *   reserved-memory {
+ *       fpga_image: fpga-image@1f000000 {
+ *           reg = <0x1f000000 0x400000>;
+ *       };
+ *   };
+ *
+ * If 'autoload' is set then this image (the first 'image-size' bytes of the region, by
+ * default all of it) is loaded when the driver is bound, instead of 'file' and without
+ * any file system access. This load is always synchronous. With 'memory-region-release'
+ * the region is returned to the page allocator once the image has been loaded, which
+ * requires the driver to be built into the kernel. The built-in driver registers at
+ * 'subsys_initcall_sync' level (probing is deferred until the fpga_manager shows up), so
+ * that the fabric can come up before the root file system is mounted. Note that
+ * 'autodiscover' only finds managers which have been registered at that point and
+ * that on kernels which register SHA-256 later (at module_init level) the loads
+ * during boot have no digest (i.e., 'skip_identical' and the digest in /chosen
+ * have no effect).
+ *
  *
  * When the driver is bound then it will add a few sysfs properties to the device
  *
@@ -45,12 +94,121 @@
  *    file:     name of firmware file; if 'autoload' is nonzero then writing a filename
  *              to 'file' triggers programming.
  *
- *    autoload: whether binding the driver or writing 'file' triggers programming
+ *    autoload: whether binding the driver or writing 'file' triggers programming;
+ *              'if-unconfigured' only programs on binding if the FPGA is not configured
+ *              yet (see below).
+ *
+ *    program:  writing nonzero here triggers programming (required if autoload is zero);
+ *              writing 'force' reprograms even if 'skip_identical' is set.
+ *              'urgent' does the same as 'force' but ahead of all other waiting loads
+ *              (see SCHEDULING).
+ *
+ *    skip_identical: when nonzero then programming is skipped if the SHA-256 digest of the
+ *              image matches the one of the last successfully loaded image and the
+ *              fpga_manager still reports the 'operating' state.
+ *
+ *    digest:   SHA-256 digest of the last successfully loaded image (empty if unknown).
+ *
+ *    last_load: '<digest> <size> <time>' of the last successful load: the SHA-256 digest
+ *              of the bytes handed to the fpga_manager ('-' if unknown), their number and
+ *              the time of completion (seconds since the epoch, with nanoseconds). The
+ *              digest is computed while the image is read, copied or decompressed, i.e.,
+ *              the data are not traversed a second time. Images which are not handled
+ *              that way (firmware loader, .bit files which are not byte-swapped, dma-buf,
+ *              memfd, user memory, 'memory-region') cost an extra pass over the image.
+ *              Clearing the 'audit_digest' module parameter avoids it unless
+ *              'skip_identical' needs the digest; 'digest' and the digest in 'last_load'
+ *              are unknown for such images then.
+ *
+ *    expected_part: .bit files whose header names a different part are rejected (ENOEXEC)
+ *              before the device is touched. The comparison is case-insensitive, the
+ *              shorter of both names must be a prefix of the other and a leading 'xc' is
+ *              ignored (e.g., '7z020' or 'xc7z020clg484-1' match '7z020clg484'). Empty
+ *              (the default) disables the check.
+ *
+ *    bit_swap: when nonzero then the payload of .bit files is byte-swapped (32-bit words)
+ *              as required by some managers (e.g., zynq).
+ *
+ *    loader:   how images are read: 'firmware' (the default) uses the kernel's firmware
+ *              loader, which needs one contiguous (vmalloc'ed) buffer. 'pages' reads the
+ *              image into individually allocated pages which are handed to the manager as
+ *              a scatter-gather table (the manager may DMA from them directly). Absolute
+ *              paths are used as given; other names are searched in /lib/firmware/updates/
+ *              <release>, /lib/firmware/updates, /lib/firmware/<release> and /lib/firmware
+ *              (the firmware loader's 'path' parameter is not honoured). Images which are
+ *              cached (see IMAGE CACHE) are always page-backed.
+ *
+ *    stage:    writing an image name fetches the image into memory ahead of time (the FPGA
+ *              keeps operating). A subsequent load of the same image (via 'file', 'program'
+ *              or 'region') then merely configures the device from memory and drops the
+ *              staged image. Reading reports the name and the (uncompressed) size of the
+ *              staged image; writing an empty line drops it.
+ *
+ *    flags:    flags passed to the fpga_manager when loading 'file' (FPGA_MGR_xxx, see
+ *              linux/fpga/fpga-mgr.h; e.g., 1 = FPGA_MGR_PARTIAL_RECONFIG).
+ *
+ *    partial_images: named set of partial images for a reconfigurable partition. Writing
+ *              'name path' adds (or replaces) an entry, writing '-name' removes it. Reading
+ *              lists the entries, one per line.
+ *
+ *    region:   writing the name of one of the 'partial_images' loads this image with
+ *              partial reconfiguration (regardless of 'flags'), leaving the static base
+ *              image (loaded from 'file') alone. Reading reports the name of the partial
+ *              image that was loaded last (empty after a full reconfiguration).
  *
- *    program:  writing nonzero here triggers programming (required if autoload is zero)
+ *    stats/:   programming latency statistics, one file per phase: 'fetch' (reading the
+ *              image), 'acquire' (obtaining the fpga_manager), 'load' (the manager
+ *              programming the device), 'total' and 'wait' (waiting for the scheduler;
+ *              see SCHEDULING). Each reports
+ *
+ *                  <count> <last> <min> <max> <mean>
+ *
+ *              (times in microseconds); the '<phase>_hist' files hold a histogram of
+ *              the latencies with logarithmic bins (bin 0: < 1us, bin n: [2^(n-1), 2^n) us).
+ *              Writing nonzero to 'stats/reset' clears all statistics.
+ *
+ *              'stats/image' reports the stored and the loaded size (bytes) of the last
+ *              image (these differ for compressed images).
+ *
+ *    async:    when nonzero then writing 'file' or 'program' merely queues a programming
+ *              job and returns immediately. The outcome must be obtained from 'state'.
+ *
+ *    priority: scheduling priority of the programming requests of this device (integer,
+ *              higher goes first; default 0; see SCHEDULING).
+ *
+ *    cancel:   writing nonzero cancels the pending request and a load waiting for its turn
+ *              (see SCHEDULING); both fail with ECANCELED. A load in progress is not
+ *              affected. The write fails with ENOENT if there was nothing to cancel.
+ *
+ *    state:    programming state ('idle', 'queued', 'loading', 'done' or 'error') followed
+ *              by the status (errno) of the last programming attempt. This attribute
+ *              supports poll()/select(); userspace is notified whenever the state changes.
+ *
+ *              Programming requests (from sysfs, the character device etc.) are serialized.
+ *              Requests arriving while a load is in progress are coalesced: only the most
+ *              recent one is executed once the current load finishes; superseded requests
+ *              fail with ESTALE. While such a request is pending the state goes from
+ *              'loading' directly to 'queued'; 'done' and 'error' are only reported once
+ *              there is nothing left to execute.
  *
  * The device-tree use-case allows to automatically load a default firmware file during
- * boot-up.
+ * boot-up. By default, this happens synchronously while the device is probed. Setting
+ * the 'deferred_autoload' module parameter (or 'async' for the device) queues the
+ * autoload job instead; with the 'async_probe' module parameter the driver core probes
+ * the programmers asynchronously, too. Thus, several FPGAs are programmed concurrently
+ * without stalling the boot. Their 'state' ('queued', 'loading', 'done' or 'error')
+ * can be polled by services depending on the FPGA. If the fpga_manager has not been
+ * registered yet then probing is deferred until it shows up.
+ *
+ * With 'autoload = "if-unconfigured"' the image is not loaded at boot if the
+ * fpga_manager reports the 'operating' state, i.e., the bootloader has configured the
+ * FPGA already; the fabric devices are created right away and 'state' reads 'done'. If
+ * the bootloader also passes the SHA-256 digest of its image as the property
+ * 'fpga-prog,<device>-digest' of /chosen (32 bytes or a hex string; <device> is the
+ * name of the programmer device, e.g., 'prog-fpga0') then the image is fetched and
+ * only loaded if its digest differs:
+ *
+ *   fdt set /chosen fpga-prog,prog-fpga0-digest "<sha256sum of the image>"
  *
  * 2. No device-tree
  *
@@ -91,6 +249,141 @@
  *
  * Soft devices can be removed (write nonzero to 'remove').
  *
+ * A manager without device-tree node is referenced by the name of its parent platform
+ * device instead of a path (any string not starting with '/'), e.g.,
+ *
+ *   echo -n 'fpga-prog-mock.0' > /sys/bus/platform/drivers/fpga_programmer/add_programmer
+ *
+ * Several programmers can be added with a single write (paths or names separated by
+ * whitespace or ';'); '*' adds programmers for all registered managers which are not
+ * in use yet. The write fails with the first error; reading 'add_programmer' reports
+ * '<entry> <errno>' for each entry of the last write ('*' expands to the names of the
+ * managers, e.g., 'fpga0'). Setting the 'autodiscover' module parameter does the same
+ * as writing '*' when the driver is loaded.
+ *
+ * MANIFEST
+ *
+ * Several FPGAs can be programmed in parallel by writing a manifest to the driver's
+ * 'manifest' attribute. Each line (or ';'-separated entry) names a programmer device
+ * and the image to load (which becomes the device's 'file'), optionally followed by
+ * programmers (listed earlier in the manifest) which must be completed first:
+ *
+ *   cat > /sys/bus/platform/drivers/fpga_programmer/manifest <<EOF
+ *   prog-fpga.0 base.bin
+ *   prog-fpga.1 io.bin
+ *   prog-fpga.2 app.bin after prog-fpga.0
+ *   EOF
+ *
+ * Independent entries are executed concurrently by up to 'manifest_workers' (module
+ * parameter) workers; an entry whose dependency fails is not programmed (-ECANCELED).
+ * Reading 'manifest' reports '<programmer> <image> <state> <errno>' for each entry
+ * ('idle' means waiting for dependencies). A new manifest is refused (-EBUSY) while
+ * the previous one is still executing.
+ *
+ * SCHEDULING
+ *
+ * Programming jobs of all programmers pass through a driver-wide scheduler before
+ * they fetch the image and acquire the fpga_manager. At most 'max_concurrent_loads'
+ * (module parameter, may be changed at run-time; 0, the default, means unlimited)
+ * jobs run at the same time, e.g., when several managers share an interconnect or DMA
+ * engine. The others wait, highest 'priority' first and in order of arrival among
+ * equal priorities; 'urgent' requests (see 'program') go ahead of everything else.
+ * A waiting job holds neither the manager nor any lock of its programmer (whose
+ * 'state' remains 'queued') and can be cancelled (see 'cancel'). The driver attribute
+ * 'sched_stats' reports the number of running and waiting jobs, the limit and the
+ * number, mean and maximum of the wait times (microseconds); 'stats/wait' has the
+ * wait times of each programmer.
+ *
+ * CHARACTER DEVICE
+ *
+ * Each programmer also creates a character device '/dev/fpga-progN'. Writing a
+ * bitstream to this device and closing it programs the FPGA directly from the
+ * written data, i.e., the image needs not be stored in a file first. Data are
+ * kept in individually allocated pages (no large contiguous buffer) and the
+ * size is limited by the 'max_image_size' module parameter. The device can be
+ * opened by one process at a time; the status of the programming operation is
+ * returned by close().
+ *
+ *      cat something.bin > /dev/fpga-prog0
+ *
+ * Alternatively, an image held in a dma-buf or in a sealed memfd can be programmed
+ * without any copy by passing the file descriptor to the FPGA_PROG_IOC_LOAD_FD
+ * ioctl (see fpga_prog_ioctl.h). An image in the caller's memory (e.g., an mmap()ed
+ * file or a hugepage buffer) is programmed in place by FPGA_PROG_IOC_LOAD_USER: the
+ * pages are pinned for the duration of the load and the durations of the phases
+ * are returned along with the status.
+ *
+ * IMAGE CACHE
+ *
+ * Images given by an absolute path can be cached in memory (shared by all
+ * programmers) so that repeated loads of the same file skip the storage I/O.
+ * Entries are keyed by path and file identity (device, inode, mtime, size),
+ * i.e., a modified file is re-read. The cache is enabled by setting the
+ * 'cache_max_bytes' module parameter to a nonzero value; the least recently
+ * used entries are evicted when this limit is exceeded or when the system
+ * runs low on memory. The driver attribute 'cache_stats' reports hits, misses,
+ * the number of entries and the memory used.
+ *
+ * XILINX .BIT FILES
+ *
+ * .bit files (recognized by their header) are converted by the driver: the header is
+ * parsed (see 'expected_part') and stripped and the payload optionally byte-swapped
+ * (see 'bit_swap'). This happens once when the image is fetched; cached and staged
+ * images are kept in converted form. Images written to the character device or
+ * passed by file descriptor are not converted.
+ *
+ * Independent of the image cache (which is disabled by default), each programmer
+ * keeps the last converted .bit image given by an absolute path (any name with
+ * the 'pages' loader) in memory, so that loading the same, unmodified file again
+ * neither reads nor converts it. This costs the memory of one image per programmer;
+ * clearing the 'bit_keep_last' module parameter disables it (the kept image is
+ * released by the next load).
+ *
+ * COMPRESSED IMAGES
+ *
+ * Images compressed with gzip, xz or zstd (detected by their magic number, not
+ * the file name) are transparently decompressed (provided that the respective
+ * decompressor is enabled in the kernel). Files given by an absolute path are
+ * decompressed while they are read, i.e., the compressed image is never held
+ * in memory as a whole. 'stats/image' reports the stored (compressed) and the
+ * loaded (uncompressed) size of the last image.
+ *
+ * Concatenated gzip members, zstd frames or xz streams are decompressed in
+ * sequence (as the userspace tools do); any other data following the compressed
+ * stream are rejected. The CRC32 and length in the trailer of gzip members
+ * are verified.
+ *
+ * UEVENTS
+ *
+ * Each programming job (including autoload) emits 'change' uevents on the programmer
+ * device when it starts and when it completes, carrying
+ *
+ *   FPGA_PROG_EVENT=start|done|error
+ *   FPGA_PROG_IMAGE=<name>       (unless the image came from the character device or an fd)
+ *   FPGA_PROG_PARTIAL=1          (partial image loaded via 'region')
+ *   FPGA_PROG_DURATION_US=<us>   (done, error)
+ *   FPGA_PROG_ERRNO=<errno>      (error)
+ *   FPGA_PROG_PENDING=1          (done, error; another request is executed next)
+ *
+ * so that udev rules and services can react without polling, e.g.,
+ *
+ *   ACTION=="change", SUBSYSTEM=="platform", ENV{FPGA_PROG_EVENT}=="done", RUN+="..."
+ *
+ * TRACING
+ *
+ * The programming lifecycle (requests, manager acquire/release, load start/end,
+ * soft device creation/removal and autoload) can be traced with the events of the
+ * 'fpga_prog' group (see fpga_prog_trace.h).
+ *
+ * TESTING WITHOUT HARDWARE
+ *
+ * The companion module fpga_prog_mockmgr registers software fpga_managers (platform
+ * devices 'fpga-prog-mock.<n>') with configurable write throughput, per-phase latency
+ * and error injection (see fpga_prog_mockmgr.c). 'make host' builds both modules for
+ * the running kernel; scripts/fpga_prog_bench.sh measures programming latency and
+ * throughput through 'file' or 'program'. scripts/fpga_prog_scale.sh creates and
+ * removes hundreds of soft programmers (cost per operation as their number grows).
+ *
  * PROGRAMMING (identical for use case 1. and 2.):
  *
  *  E.g.:
@@ -104,11 +397,71 @@
 #include <linux/printk.h>
 #include <linux/device.h>
 #include <linux/of.h>
+#include <linux/of_platform.h>
+#include <linux/of_address.h>
 #include <linux/slab.h>
 #include <linux/fpga/fpga-mgr.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/completion.h>
+#include <linux/kref.h>
+#include <linux/atomic.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/scatterlist.h>
+#include <linux/file.h>
+#include <linux/shmem_fs.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-direction.h>
+#include <linux/list.h>
+#include <linux/hashtable.h>
+#include <linux/stat.h>
+#include <linux/shrinker.h>
+#include <linux/firmware.h>
+#include <linux/namei.h>
+#include <generated/utsrelease.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/vmalloc.h>
+#include <linux/swab.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,12,0)
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
+#if IS_ENABLED(CONFIG_ZLIB_INFLATE)
+#include <linux/zlib.h>
+#include <linux/crc32.h>
+#endif
+#if IS_ENABLED(CONFIG_XZ_DEC)
+#include <linux/xz.h>
+#endif
+#if IS_ENABLED(CONFIG_ZSTD_DECOMPRESS)
+#include <linux/zstd.h>
+#endif
+#include <crypto/hash.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,18,0)
+#include <linux/iosys-map.h>
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,11,0)
+#include <linux/dma-buf-map.h>
+#endif
+
+#include "fpga_prog_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "fpga_prog_trace.h"
 
 MODULE_LICENSE("Dual BSD/GPL");
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+MODULE_IMPORT_NS("DMA_BUF");
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,16,1)
 #define FW_NAME firmware_name
@@ -125,6 +478,19 @@ static struct platform_driver fpga_prog_driver;
 
 static ssize_t
 add_programmer_store(struct device_driver *drv, const char *buf, size_t sz);
+static ssize_t
+add_programmer_show(struct device_driver *drv, char *buf);
+
+static ssize_t
+cache_stats_show(struct device_driver *drv, char *buf);
+
+static ssize_t
+sched_stats_show(struct device_driver *drv, char *buf);
+
+static ssize_t
+manifest_store(struct device_driver *drv, const char *buf, size_t sz);
+static ssize_t
+manifest_show(struct device_driver *drv, char *buf);
 
 static ssize_t
 remove_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz);
@@ -142,6 +508,77 @@ autoload_store(struct device *dev, struct device_attribute *att, const char *buf
 static ssize_t
 autoload_show(struct device *dev, struct device_attribute *att, char *buf);
 
+static ssize_t
+async_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz);
+static ssize_t
+async_show(struct device *dev, struct device_attribute *att, char *buf);
+
+static ssize_t
+state_show(struct device *dev, struct device_attribute *att, char *buf);
+
+static ssize_t
+skip_identical_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz);
+static ssize_t
+skip_identical_show(struct device *dev, struct device_attribute *att, char *buf);
+
+static ssize_t
+digest_show(struct device *dev, struct device_attribute *att, char *buf);
+
+static ssize_t
+last_load_show(struct device *dev, struct device_attribute *att, char *buf);
+
+static ssize_t
+expected_part_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz);
+static ssize_t
+expected_part_show(struct device *dev, struct device_attribute *att, char *buf);
+
+static ssize_t
+bit_swap_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz);
+static ssize_t
+bit_swap_show(struct device *dev, struct device_attribute *att, char *buf);
+
+static ssize_t
+loader_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz);
+static ssize_t
+loader_show(struct device *dev, struct device_attribute *att, char *buf);
+
+static ssize_t
+priority_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz);
+static ssize_t
+priority_show(struct device *dev, struct device_attribute *att, char *buf);
+
+static ssize_t
+cancel_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz);
+
+static ssize_t
+stage_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz);
+static ssize_t
+stage_show(struct device *dev, struct device_attribute *att, char *buf);
+
+static ssize_t
+flags_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz);
+static ssize_t
+flags_show(struct device *dev, struct device_attribute *att, char *buf);
+
+static ssize_t
+partial_images_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz);
+static ssize_t
+partial_images_show(struct device *dev, struct device_attribute *att, char *buf);
+
+static ssize_t
+region_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz);
+static ssize_t
+region_show(struct device *dev, struct device_attribute *att, char *buf);
+
+static ssize_t
+stats_show(struct device *dev, struct device_attribute *att, char *buf);
+static ssize_t
+stats_hist_show(struct device *dev, struct device_attribute *att, char *buf);
+static ssize_t
+stats_reset_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz);
+static ssize_t
+stats_image_show(struct device *dev, struct device_attribute *att, char *buf);
+
 static int
 fpga_prog_probe(struct platform_device *pdev);
 static int
@@ -151,13 +588,65 @@ static struct fpga_prog_drvdat *
 get_drvdat(struct device *dev);
 
 static void
-release_drvdat(struct fpga_prog_drvdat *prg);
+put_drvdat(struct fpga_prog_drvdat *prg);
+
+static int
+prog_misc_register(struct fpga_prog_drvdat *prg);
+
+static void
+prog_misc_deregister(struct fpga_prog_drvdat *prg);
 
 static void
 release_pdev(struct device *dev);
 
+struct fpga_prog_job;
+
+static int
+load_fw(struct fpga_prog_drvdat *prg, struct fpga_prog_job *job);
+
+struct fpga_prog_src;
+
+static int
+load_src(struct fpga_prog_drvdat *prg, struct fpga_prog_src *src, unsigned opts);
+
+static void
+sched_kick(void);
+
+struct fpga_prog_img;
+
+static void
+img_free(struct fpga_prog_img *img);
+
+static int
+img_decompress_buf(struct fpga_prog_img *img, const void *buf, size_t size);
+
+static int
+img_read_image(struct fpga_prog_img *img, struct file *f, loff_t size);
+
+struct fpga_prog_fetched;
+
+static void
+fetched_release(struct fpga_prog_fetched *fet);
+
 static int
-load_fw(struct fpga_prog_drvdat *prg);
+bit_convert(struct fpga_prog_src *src, struct fpga_prog_img *img, int swap, char *part);
+
+struct fpga_prog_cent;
+
+static struct fpga_prog_cent *
+cache_get(const char *path, int swap);
+
+static struct fpga_prog_cent *
+keep_get(struct fpga_prog_drvdat *prg, const char *path);
+
+static void
+keep_drop(struct fpga_prog_drvdat *prg);
+
+static void
+cache_put(struct fpga_prog_cent *cent);
+
+static void
+load_work(struct work_struct *work);
 
 
 #define OF_COMPAT "tills,fpga-programmer-1.0"
@@ -166,41 +655,469 @@ static const char *drvnam = "prog-fpga";
 
 static DEFINE_IDA(fpga_prog_ida);
 
+/* Numbering of the /dev/fpga-progN character devices
+ */
+static DEFINE_IDA(fpga_prog_cdev_ida);
+
+/* Upper limit for images held in memory by this driver
+ */
+static unsigned long max_image_size = 256UL << 20;
+module_param( max_image_size, ulong, 0644 );
+MODULE_PARM_DESC( max_image_size, "Max. size of an image buffered by the driver (bytes)" );
+
+/* Memory available to the image cache (0 disables the cache)
+ */
+static unsigned long cache_max_bytes = 0;
+module_param( cache_max_bytes, ulong, 0644 );
+MODULE_PARM_DESC( cache_max_bytes, "Max. memory used for caching images (bytes; 0 disables cache)" );
+
+/* Keep the last converted .bit image of each programmer (independent
+ * of the image cache)
+ */
+static bool bit_keep_last = 1;
+module_param( bit_keep_last, bool, 0644 );
+MODULE_PARM_DESC( bit_keep_last, "Keep the last converted .bit image of each programmer in memory" );
+
+/* Let the driver core probe devices asynchronously
+ */
+static bool async_probe = 0;
+module_param( async_probe, bool, 0444 );
+MODULE_PARM_DESC( async_probe, "Prefer asynchronous probing" );
+
+/* Queue the autoload job rather than programming in probe
+ */
+static bool deferred_autoload = 0;
+module_param( deferred_autoload, bool, 0644 );
+MODULE_PARM_DESC( deferred_autoload, "Autoload from a work queue (don't block probe)" );
+
+/* Asynchronous programming jobs are executed here
+ */
+static struct workqueue_struct *fpga_prog_wq;
+
+/* Number of manifest entries programmed in parallel
+ */
+static unsigned int manifest_workers = 4;
+module_param( manifest_workers, uint, 0444 );
+MODULE_PARM_DESC( manifest_workers, "Max. number of FPGAs programmed in parallel from a manifest" );
+
+static struct workqueue_struct *fpga_prog_manifest_wq;
+
+/* Record the digest of every loaded image (see 'last_load'); images which
+ * are not hashed while they are read cost an extra pass
+ */
+static bool audit_digest = 1;
+module_param( audit_digest, bool, 0644 );
+MODULE_PARM_DESC( audit_digest, "Hash every loaded image (N: only if skip_identical needs it)" );
+
+/* Create soft programmers for all fpga_managers at module init
+ */
+static bool autodiscover = 0;
+module_param( autodiscover, bool, 0444 );
+MODULE_PARM_DESC( autodiscover, "Create programmers for all fpga_managers at init" );
+
+/* Max. number of programmers loading their device at the same time
+ * (0: unlimited); raising the limit admits waiting loads right away.
+ */
+static unsigned int max_concurrent_loads = 0;
+
+static int
+max_concurrent_loads_set(const char *val, const struct kernel_param *kp)
+{
+int err;
+
+	if ( (err = param_set_uint( val, kp )) ) {
+		return err;
+	}
+	sched_kick();
+	return 0;
+}
+
+static const struct kernel_param_ops max_concurrent_loads_ops = {
+	.set = max_concurrent_loads_set,
+	.get = param_get_uint,
+};
+
+module_param_cb( max_concurrent_loads, &max_concurrent_loads_ops, &max_concurrent_loads, 0644 );
+MODULE_PARM_DESC( max_concurrent_loads, "Max. number of concurrent loads, all programmers (0 = unlimited)" );
+
+/* Options for a programming job
+ */
+#define FPGA_PROG_OPT_FORCE     (1<<0) /* program even if the image is identical      */
+#define FPGA_PROG_OPT_PARTIAL   (1<<1) /* load the requested partial image            */
+#define FPGA_PROG_OPT_URGENT    (1<<2) /* schedule ahead of all other requests        */
+#define FPGA_PROG_OPT_IDENTICAL (1<<3) /* skip an identical image (as skip_identical) */
+
+/* Values of 'autoload' (any other nonzero value is normalized to 1)
+ */
+#define FPGA_PROG_AUTOLOAD_OFF             0
+#define FPGA_PROG_AUTOLOAD_ON              1
+#define FPGA_PROG_AUTOLOAD_IF_UNCONFIGURED 2
+
+/* Priority of urgent requests (above anything 'priority' can be set to)
+ */
+#define FPGA_PROG_PRIO_URGENT INT_MAX
+
+/* Digest of the loaded image (SHA-256)
+ */
+#define FPGA_PROG_DIGEST_SIZE 32
+
+/* How images are fetched: the firmware loader (one contiguous
+ * buffer) or reading the file into individual pages
+ */
+#define FPGA_PROG_LOADER_FIRMWARE 0
+#define FPGA_PROG_LOADER_PAGES    1
+
+static const char * const loader_names[] = { "firmware", "pages" };
+
+/* Max. length of a part name (.bit header)
+ */
+#define FPGA_PROG_PART_MAX    32
+
+static struct crypto_shash *digest_tfm;
+
+
+DRIVER_ATTR_RW( add_programmer );
+DRIVER_ATTR_RO( cache_stats    );
+DRIVER_ATTR_RW( manifest       );
+DRIVER_ATTR_RO( sched_stats    );
+
+static struct driver_attribute *drv_attrs[] = {
+	&driver_attr_add_programmer,
+	&driver_attr_cache_stats,
+	&driver_attr_manifest,
+	&driver_attr_sched_stats,
+};
 
-DRIVER_ATTR_WO( add_programmer );
+#define N_DRV_ATTRS (sizeof(drv_attrs)/sizeof(drv_attrs[0]))
 
 DEVICE_ATTR_WO( remove   );
 DEVICE_ATTR_RW( file     );
 DEVICE_ATTR_WO( program  );
 DEVICE_ATTR_RW( autoload );
+DEVICE_ATTR_RW( async    );
+DEVICE_ATTR_RO( state    );
+DEVICE_ATTR_RW( skip_identical );
+DEVICE_ATTR_RO( digest   );
+DEVICE_ATTR_RO( last_load );
+DEVICE_ATTR_RW( flags    );
+DEVICE_ATTR_RW( partial_images );
+DEVICE_ATTR_RW( region   );
+DEVICE_ATTR_RW( stage    );
+DEVICE_ATTR_RW( expected_part );
+DEVICE_ATTR_RW( bit_swap );
+DEVICE_ATTR_RW( loader   );
+DEVICE_ATTR_RW( priority );
+DEVICE_ATTR_WO( cancel   );
 
 static struct device_attribute *dev_attrs[] = {
 	&dev_attr_program,
 	&dev_attr_file,
 	&dev_attr_autoload,
+	&dev_attr_async,
+	&dev_attr_state,
+	&dev_attr_skip_identical,
+	&dev_attr_digest,
+	&dev_attr_last_load,
+	&dev_attr_flags,
+	&dev_attr_partial_images,
+	&dev_attr_region,
+	&dev_attr_stage,
+	&dev_attr_expected_part,
+	&dev_attr_bit_swap,
+	&dev_attr_loader,
+	&dev_attr_priority,
+	&dev_attr_cancel,
 };
 
 #define N_DEV_ATTRS (sizeof(dev_attrs)/sizeof(dev_attrs[0]))
 
+/* Programming phases for which latency statistics are kept
+ */
+enum fpga_prog_phase {
+	FPGA_PROG_PHASE_FETCH = 0,
+	FPGA_PROG_PHASE_ACQUIRE,
+	FPGA_PROG_PHASE_LOAD,
+	FPGA_PROG_PHASE_TOTAL,
+	FPGA_PROG_PHASE_WAIT,
+	FPGA_PROG_N_PHASES
+};
+
+/* Latency histogram bins; bin 0 counts latencies < 1us,
+ * bin n counts [2^(n-1), 2^n) us, the last bin everything above.
+ */
+#define FPGA_PROG_HIST_BINS 32
+
+struct fpga_prog_lat {
+	u64                    count;
+	/* nanoseconds */
+	u64                    last;
+	u64                    min;
+	u64                    max;
+	u64                    sum;
+	u32                    hist[FPGA_PROG_HIST_BINS];
+};
+
+#define STATS_ATTR(nam, phase) \
+	static struct dev_ext_attribute dev_attr_stats_##nam = { \
+		__ATTR( nam, 0444, stats_show, 0 ), (void*)(unsigned long)FPGA_PROG_PHASE_##phase \
+	}; \
+	static struct dev_ext_attribute dev_attr_stats_##nam##_hist = { \
+		__ATTR( nam##_hist, 0444, stats_hist_show, 0 ), (void*)(unsigned long)FPGA_PROG_PHASE_##phase \
+	}
+
+STATS_ATTR( fetch,   FETCH   );
+STATS_ATTR( acquire, ACQUIRE );
+STATS_ATTR( load,    LOAD    );
+STATS_ATTR( total,   TOTAL   );
+STATS_ATTR( wait,    WAIT    );
+
+static struct device_attribute dev_attr_stats_reset = __ATTR( reset, 0200, 0, stats_reset_store );
+static struct device_attribute dev_attr_stats_image = __ATTR( image, 0444, stats_image_show, 0 );
+
+static struct attribute *stats_attrs[] = {
+	&dev_attr_stats_fetch.attr.attr,
+	&dev_attr_stats_fetch_hist.attr.attr,
+	&dev_attr_stats_acquire.attr.attr,
+	&dev_attr_stats_acquire_hist.attr.attr,
+	&dev_attr_stats_load.attr.attr,
+	&dev_attr_stats_load_hist.attr.attr,
+	&dev_attr_stats_total.attr.attr,
+	&dev_attr_stats_total_hist.attr.attr,
+	&dev_attr_stats_wait.attr.attr,
+	&dev_attr_stats_wait_hist.attr.attr,
+	&dev_attr_stats_reset.attr,
+	&dev_attr_stats_image.attr,
+	0
+};
+
+static const struct attribute_group stats_group = {
+	.name  = "stats",
+	.attrs = stats_attrs,
+};
+
+/* Reference to an fpga_manager: either its OF node or - for managers
+ * which are not described by the device tree - its parent device.
+ * Only one of the members is set and we hold a reference to it.
+ */
+struct fpga_prog_mref {
+	struct device_node    *node;
+	struct device         *dev;
+};
+
 /* 'Soft' programmer device - used if we don't have a device-tree entry
  */
 struct fpga_prog_dev {
 	struct platform_device pdev;
-    /* Keep a reference to the fpga_manager's of_node;
+    /* Keep a reference to the fpga_manager's of_node (or device);
 	 * we hold it for the lifetime of this device
 	 */
-	struct device_node    *mgrNode;
+	struct fpga_prog_mref  mref;
+	/* Entry in 'soft_index' */
+	struct hlist_node      idx;
+};
+
+/* Programming state as reported by the 'state' attribute
+ */
+enum fpga_prog_state {
+	FPGA_PROG_IDLE = 0,
+	FPGA_PROG_QUEUED,
+	FPGA_PROG_LOADING,
+	FPGA_PROG_DONE,
+	FPGA_PROG_ERROR
+};
+
+static const char *state_names[] = {
+	[FPGA_PROG_IDLE]    = "idle",
+	[FPGA_PROG_QUEUED]  = "queued",
+	[FPGA_PROG_LOADING] = "loading",
+	[FPGA_PROG_DONE]    = "done",
+	[FPGA_PROG_ERROR]   = "error",
+};
+
+/* Image held in individually allocated pages (avoids a large
+ * contiguous buffer); it is handed to the manager as a sg_table.
+ * The data start at offset 'off' into the first page.
+ */
+struct fpga_prog_img {
+	struct page           **pages;
+	unsigned int            npages;
+	unsigned int            maxpages;
+	size_t                  off;
+	size_t                  size;
+	/* Digest of the image; computed while the image is
+	 * filled (see img_hash_start()) if possible
+	 */
+	struct shash_desc      *hash;
+	u8                      digest[FPGA_PROG_DIGEST_SIZE];
+	int                     digest_valid;
+};
+
+/* Cached image; the cache holds one reference while the
+ * entry is on the LRU list, each user holds another one.
+ */
+struct fpga_prog_cent {
+	struct list_head        lru;
+	struct kref             ref;
+	char                   *path;
+	/* file identity */
+	dev_t                   dev;
+	u64                     ino;
+	s64                     mtime_sec;
+	long                    mtime_nsec;
+	loff_t                  fsize;
+	/* .bit payload has been byte-swapped */
+	int                     swap;
+	/* converted from a .bit file */
+	int                     bit;
+	/* part name from the .bit header (empty if none) */
+	char                    part[FPGA_PROG_PART_MAX];
+	struct fpga_prog_img    img;
+};
+
+/* Source to program from; either a page-backed image
+ * or a contiguous buffer.
+ */
+struct fpga_prog_src {
+	struct fpga_prog_img   *img;
+	const void             *buf;
+	size_t                  count;
+	/* size of the stored (possibly compressed) image; 0 if the same */
+	size_t                  stored;
+	/* if non-NULL: durations of the phases of loading this source (ns) */
+	u64                    *times;
+};
+
+/* Image obtained from the cache or the firmware loader
+ * along with the resources backing 'src'.
+ */
+struct fpga_prog_fetched {
+	char                   *name;
+	struct fpga_prog_cent  *cent;
+	const struct firmware  *fw;
+	struct fpga_prog_img    img;
+	struct fpga_prog_src    src;
+	char                    part[FPGA_PROG_PART_MAX];
+};
+
+/* Programming job; programs 'src' or (if NULL) the image 'name'
+ * (a partial image if FPGA_PROG_OPT_PARTIAL is set in 'opts').
+ * The requester of a synchronous job waits for 'done' (and the
+ * job lives on its stack); asynchronous jobs are freed when done.
+ */
+struct fpga_prog_job {
+	char                   *name;
+	struct fpga_prog_src   *src;
+	unsigned                opts;
+	/* Scheduling priority (higher goes first) */
+	int                     prio;
+	struct completion      *done;
+	int                     err;
+};
+
+/* Named partial image
+ */
+struct fpga_prog_part {
+	struct list_head        list;
+	char                   *name;
+	char                   *path;
 };
 
 /* Programmer data
  */
 struct fpga_prog_drvdat {
+	/* The drvdat may outlive the binding (open character
+	 * device); it holds a reference to the platform device.
+	 */
+	struct kref             ref;
 	struct platform_device *pdev;
-    /* Keep a reference to the fpga_manager's of_node;
+    /* Keep a reference to the fpga_manager's of_node (or device);
 	 * we hold while the driver is attached/bound
 	 */
-	struct device_node     *mgrNode;
+	struct fpga_prog_mref   mref;
+	/* Entry in 'bound_index' (while bound) */
+	struct hlist_node      idx;
+	/* FPGA_PROG_AUTOLOAD_xxx */
 	int                    autoload;
+	/* Image preloaded by the bootloader into a reserved-memory
+	 * region ('memory-region'); loaded instead of 'file' by autoload
+	 */
+	struct fpga_prog_img  *mem_img;
+	phys_addr_t            mem_base;
+	size_t                 mem_size;
+	/* Return the region to the page allocator once loaded */
+	int                    mem_release;
+	int                    async;
+	int                    skip_identical;
+	/* Byte-swap the payload of .bit files */
+	int                    bit_swap;
+	/* How images are read (FPGA_PROG_LOADER_xxx) */
+	int                    loader;
+	/* Part the .bit files must be built for (protected by 'lock') */
+	char                   expected_part[FPGA_PROG_PART_MAX];
+	/* Job waiting to be executed; a newer request supersedes
+	 * it (protected by 'lock')
+	 */
+	struct fpga_prog_job  *pend;
+	/* Load waiting for its turn in the driver-wide scheduler
+	 * (protected by 'lock')
+	 */
+	struct fpga_prog_slot *slot;
+	/* Default priority of our requests */
+	int                    priority;
+	/* Executes the jobs
+	 */
+	struct work_struct     work;
+	/* 'lock' protects 'state', 'err', 'pend', 'slot' and 'detached'
+	 */
+	spinlock_t             lock;
+	enum fpga_prog_state   state;
+	int                    err;
+	int                    detached;
+	/* 'mutex' serializes programming
+	 */
+	struct mutex           mutex;
+	/* 'name_mutex' protects the firmware name; it is never
+	 * held while programming.
+	 */
+	struct mutex           name_mutex;
+	/* Digest of the last successfully loaded image (protected by 'lock')
+	 */
+	u8                     digest[FPGA_PROG_DIGEST_SIZE];
+	int                    digest_valid;
+	/* Latency statistics (protected by 'lock')
+	 */
+	struct fpga_prog_lat   stats[FPGA_PROG_N_PHASES];
+	size_t                 last_stored;
+	size_t                 last_loaded;
+	/* Digest and time (CLOCK_REALTIME) of the last successful
+	 * load (protected by 'lock')
+	 */
+	u8                     last_digest[FPGA_PROG_DIGEST_SIZE];
+	int                    last_digest_valid;
+	u64                    last_time_ns;
+	/* Partial images (protected by 'mutex')
+	 */
+	struct list_head       parts;
+	/* Partial image loaded last (protected by 'lock')
+	 */
+	char                  *region;
+	/* Image fetched ahead of time (protected by 'mutex')
+	 */
+	struct fpga_prog_fetched *staged;
+	/* Last converted .bit image (see 'bit_keep_last';
+	 * protected by 'lock')
+	 */
+	struct fpga_prog_cent  *kept;
+	/* OF node describing the devices implemented by the fabric
+	 * (populated while a full image is loaded; 'mutex')
+	 */
+	struct device_node     *fabric;
+	int                    fabric_populated;
+	/* Character device
+	 */
+	struct miscdevice      misc;
+	int                    misc_id;
+	atomic_t               misc_busy;
 #if !defined(HAS_NEW_API)
 	char                   *firmware_name;
 #endif
@@ -209,10 +1126,65 @@ struct fpga_prog_drvdat {
 	struct fpga_image_info info;
 };
 
-/* Retrieve the fpga_manager associated with a platform device.
- *
- * RETURNS: - the manager (exclusive ref; must be released after use)
- *          - a reference to the manager's of node (in *mgrNode)
+/* The fpga_manager class is not exported; it is learned from the first
+ * manager we obtain. The pointer remains valid since the fpga_mgr module
+ * cannot be unloaded while we use its symbols.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,4,0)
+static const struct class *mgr_class;
+#else
+static struct class       *mgr_class;
+#endif
+
+/* Record the manager class (if 'mgr' is valid); RETURNS: 'mgr'
+ */
+static struct fpga_manager *
+mgr_seen(struct fpga_manager *mgr)
+{
+	if ( ! IS_ERR( mgr ) && ! READ_ONCE( mgr_class ) ) {
+		WRITE_ONCE( mgr_class, mgr->dev.class );
+	}
+	return mgr;
+}
+
+/* Obtain the manager from a reference (exclusive ref; must be released after use)
+ */
+static struct fpga_manager *
+mref_get_mgr(const struct fpga_prog_mref *mref)
+{
+	if ( mref->node ) {
+		return mgr_seen( of_fpga_mgr_get( mref->node ) );
+	}
+	return mgr_seen( fpga_mgr_get( mref->dev ) );
+}
+
+/* Drop the reference to the node (or device)
+ */
+static void
+mref_put(struct fpga_prog_mref *mref)
+{
+	if ( mref->node ) {
+		of_node_put( mref->node );
+	}
+	if ( mref->dev ) {
+		put_device( mref->dev );
+	}
+	mref->node = 0;
+	mref->dev  = 0;
+}
+
+/* Key identifying the manager (for lookup of existing programmers)
+ */
+static void *
+mref_key(const struct fpga_prog_mref *mref)
+{
+	return mref->node ? (void*)mref->node : (void*)mref->dev;
+}
+
+/* Retrieve the fpga_manager associated with a platform device.
+ *
+ * RETURNS: - the manager (exclusive ref; must be released after use)
+ *          - a reference to the manager's of node or device (in *mref)
  *
  * If this routine fails then no reference (neither to the manager nor of-node)
  * is held. On error, a status is encoded in the pointer return value.
@@ -228,17 +1200,28 @@ struct fpga_prog_drvdat {
  */
 
 static struct fpga_manager*
-of_get_mgr_from_pdev(struct platform_device *pdev, struct device_node **mgrNode)
+of_get_mgr_from_pdev(struct platform_device *pdev, struct fpga_prog_mref *mref)
 {
 struct device_node   *pnod = pdev->dev.of_node;
 struct device_node   *mnod = 0;
 struct fpga_manager  *mgr  = ERR_PTR( -ENODEV );
 struct fpga_prog_dev *prgd;
 
+	mref->node = 0;
+	mref->dev  = 0;
+
 	if ( ! pnod ) {
 		/* this is a fpga_prog_dev (run-time created; no OF) */
 		prgd = container_of( pdev, struct fpga_prog_dev, pdev );
-		mnod = prgd->mgrNode;
+		if ( prgd->mref.dev ) {
+			/* manager without OF node */
+			mgr = mgr_seen( fpga_mgr_get( prgd->mref.dev ) );
+			if ( ! IS_ERR( mgr ) ) {
+				mref->dev = get_device( prgd->mref.dev );
+			}
+			return mgr;
+		}
+		mnod = prgd->mref.node;
 		/* increment ref-count */
 		of_node_get( mnod );
 	} else {
@@ -263,16 +1246,27 @@ struct fpga_prog_dev *prgd;
 	 * (also with incremented ref-count) or mknod == NULL and an error
 	 * code in 'mgr'.
 	 */
-	*mgrNode = mnod;
-	return mgr;
+	mref->node = mnod;
+	return mgr_seen( mgr );
 }
 
 
+/* Match a manager device by the name of its parent
+ */
+static int
+mgr_parent_match(struct device *dev, const void *data)
+{
+	return dev->parent && 0 == strcmp( dev_name( dev->parent ), data );
+}
+
 /* Retrieve an fpga_manager from its OF path (this is the device-tree path; not 
- * the sysfs path!)
+ * the sysfs path!). A path not starting with '/' is the name of the platform
+ * device which is the parent of the manager (managers without OF node; e.g.,
+ * fpga_prog_mockmgr). The latter walks the (few) members of the fpga_manager
+ * class rather than the entire platform bus once the class is known.
  *
  * RETURNS: - the manager (exclusive ref; must be released after use)
- *          - a reference to the manager's of node (in *mgrNode)
+ *          - a reference to the manager's of node or device (in *mref)
  *
  * If this routine fails then no reference (neither to the manager nor of-node)
  * is held. On error, a status is encoded in the pointer return value.
@@ -280,14 +1274,43 @@ struct fpga_prog_dev *prgd;
  */
 
 static struct fpga_manager *
-of_get_mgr_from_path(const char *path, struct device_node **mgrNode)
+get_mgr_from_path(const char *path, struct fpga_prog_mref *mref)
 {
-struct device_node  *mnod = of_find_node_by_path( path );
+struct device_node  *mnod = 0;
+struct device       *mdev = 0;
+struct device       *cdev;
 struct fpga_manager *mgr  = ERR_PTR( -ENOENT );
 
-	if ( mnod ) {
+	mref->node = 0;
+	mref->dev  = 0;
 
-		mgr = of_fpga_mgr_get( mnod );
+	if ( '/' != path[0] ) {
+		if ( READ_ONCE( mgr_class ) ) {
+			if ( (cdev = class_find_device( mgr_class, 0, path, mgr_parent_match )) ) {
+				mdev = get_device( cdev->parent );
+				put_device( cdev );
+			}
+		} else {
+			mdev = bus_find_device_by_name( &platform_bus_type, 0, path );
+		}
+		if ( mdev ) {
+			mgr = mgr_seen( fpga_mgr_get( mdev ) );
+			if ( IS_ERR( mgr ) ) {
+				put_device( mdev );
+			} else if ( mdev->of_node ) {
+				/* same key as if referenced by path */
+				mref->node = of_node_get( mdev->of_node );
+				put_device( mdev );
+			} else {
+				mref->dev = mdev;
+			}
+		}
+		return mgr;
+	}
+
+	if ( (mnod = of_find_node_by_path( path )) ) {
+
+		mgr = mgr_seen( of_fpga_mgr_get( mnod ) );
 
 		if ( IS_ERR( mgr ) ) {
 			of_node_put( mnod );
@@ -295,554 +1318,5063 @@ struct fpga_manager *mgr  = ERR_PTR( -ENOENT );
 		}
 	}
 
-	*mgrNode = mnod;
+	mref->node = mnod;
 	return mgr;
 }
 
-/* Helper to locate a matching device which
- * is already using the fpga_manager with of-node 'data'
+/* Programmers indexed by their manager (mref_key): soft devices and
+ * programmers bound to this driver (drvdat). This avoids scanning
+ * the platform bus or the driver's device list.
  */
-static int
-cmp_mgr_node(struct device *dev, const void *data)
-{
-struct fpga_prog_drvdat *prg = get_drvdat( dev );
+#define FPGA_PROG_INDEX_BITS 6
 
-	return (const void *)prg->mgrNode == data;
-}
+static DEFINE_MUTEX( prog_index_mutex );
+static DEFINE_HASHTABLE( soft_index,  FPGA_PROG_INDEX_BITS );
+static DEFINE_HASHTABLE( bound_index, FPGA_PROG_INDEX_BITS );
 
-/* Helper to locate a matching soft device which
- * is already using the fpga_manager with of-node 'data'.
- *
- * Since it may be used on other devices we must ensure
- * that the device we use for comparison is indeed
- * one of ours - we do this by checking it's 'release'
- * member.
+/* Add a soft device to the index; fails with -EEXIST if there is
+ * already a soft device using the same manager.
  */
 static int
-cmp_release_func(struct device *dev, void *data)
+soft_index_add(struct fpga_prog_dev *prgd)
 {
-struct fpga_prog_dev *prgd;
-	if ( dev->release != release_pdev )
-		return 0;
+void                 *key = mref_key( &prgd->mref );
+struct fpga_prog_dev *p;
+int                   rval = 0;
+
+	mutex_lock( &prog_index_mutex );
+	hash_for_each_possible( soft_index, p, idx, (unsigned long)key ) {
+		if ( mref_key( &p->mref ) == key ) {
+			rval = -EEXIST;
+			break;
+		}
+	}
+	if ( 0 == rval ) {
+		hash_add( soft_index, &prgd->idx, (unsigned long)key );
+	}
+	mutex_unlock( &prog_index_mutex );
 
-	prgd = container_of( dev, struct fpga_prog_dev, pdev.dev );
+	return rval;
+}
 
-	return (void*)prgd->mgrNode == data;
+/* Remove from the index (no-op if not indexed)
+ */
+static void
+soft_index_del(struct fpga_prog_dev *prgd)
+{
+	mutex_lock( &prog_index_mutex );
+	hash_del( &prgd->idx );
+	mutex_unlock( &prog_index_mutex );
 }
 
-/* Load firmware using the fpga_manager
+/* Same for bound programmers; fails with -EEXIST if the
+ * manager is already used by another bound programmer.
  */
 static int
-load_fw(struct fpga_prog_drvdat *prg)
+bound_index_add(struct fpga_prog_drvdat *prg)
 {
-struct fpga_manager   *mgr;
-int                    err;
+void                    *key = mref_key( &prg->mref );
+struct fpga_prog_drvdat *p;
+int                      rval = 0;
+
+	mutex_lock( &prog_index_mutex );
+	hash_for_each_possible( bound_index, p, idx, (unsigned long)key ) {
+		if ( mref_key( &p->mref ) == key ) {
+			rval = -EEXIST;
+			break;
+		}
+	}
+	if ( 0 == rval ) {
+		hash_add( bound_index, &prg->idx, (unsigned long)key );
+	}
+	mutex_unlock( &prog_index_mutex );
 
-	if ( ! prg->FW_NAME )
-		return -EINVAL;
+	return rval;
+}
 
-	mgr = of_fpga_mgr_get( prg->mgrNode );
+/* Is the manager used by a bound programmer?
+ */
+static int
+bound_index_has(void *key)
+{
+struct fpga_prog_drvdat *p;
+int                      rval = 0;
 
-	if ( IS_ERR( mgr ) ) {
-		err = PTR_ERR( mgr );
-	} else {
-#if defined(HAS_NEW_API)
-		err = fpga_mgr_load( mgr, &prg->info );
-#else
-		err = fpga_mgr_firmware_load( mgr, &prg->info, prg->FW_NAME );
-#endif
-		fpga_mgr_put( mgr );
+	mutex_lock( &prog_index_mutex );
+	hash_for_each_possible( bound_index, p, idx, (unsigned long)key ) {
+		if ( mref_key( &p->mref ) == key ) {
+			rval = 1;
+			break;
+		}
 	}
+	mutex_unlock( &prog_index_mutex );
 
-	return err;
+	return rval;
 }
 
-/* Release private data associated with our
- * 'soft' device (fpga_prog_dev)
- */
 static void
-release_pdev(struct device *dev)
+bound_index_del(struct fpga_prog_drvdat *prg)
 {
-struct fpga_prog_dev *pdev = container_of( dev, struct fpga_prog_dev, pdev.dev );
-
-	of_node_put( pdev->mgrNode );
-	ida_simple_remove( &fpga_prog_ida, dev->id );
-	kfree( dev );
-
-	/* We hold on to this module for as long as any soft device exists
-	 */
-	module_put( THIS_MODULE );
+	mutex_lock( &prog_index_mutex );
+	hash_del( &prg->idx );
+	mutex_unlock( &prog_index_mutex );
 }
 
-/* Create a soft programmer device (use case 2.)
- *
- * On call: 'mgr'     -> fpga_manager with exclusive reference held
- *          'mgrNode' -> manager's of-node with refcnt incremented
- *
- * RETURN:
- *   On success (0): - the platform device was successfully added to the
- *                     system and is managed by it now.
- *                   - the reference count of 'THIS_MODULE' is incremented
- *   On failure    : - negative error status is returned
- *
- *   In any case (error or success):
- *                   - the fpga_manager is released (put)
- *                   - the reference count of 'mgrNode' is 'taken over'
- *                     (ref either held by device or dropped).
+/* Record the latency of a programming phase
  */
-static int
-create_pdev(struct fpga_manager *mgr, struct device_node *mgrNode)
+static void
+stats_record(struct fpga_prog_drvdat *prg, enum fpga_prog_phase phase, u64 ns)
 {
-struct fpga_prog_dev   *prgd = 0;
-struct fpga_prog_dev   *mem  = 0;
-int                     id   = -1;
-int                     stat;
-int                     mgrPut = 0;
+struct fpga_prog_lat *lat = &prg->stats[phase];
+u64                   us  = div_u64( ns, NSEC_PER_USEC );
+int                   bin = us ? fls64( us ) : 0;
 
-	if ( ! ( prgd = kzalloc( sizeof(*prgd), GFP_KERNEL ) ) ) {
-		stat = -ENOMEM;
-		goto bail;
+	if ( bin >= FPGA_PROG_HIST_BINS ) {
+		bin = FPGA_PROG_HIST_BINS - 1;
 	}
 
-	mem = prgd;
-
-	prgd->pdev.name = "prog-fpga";
-
-	id = ida_simple_get( &fpga_prog_ida, 0, 0, GFP_KERNEL );
-	if ( id < 0 ) {
-		stat = id;
-		goto bail;
+	spin_lock( &prg->lock );
+	if ( 0 == lat->count || ns < lat->min ) {
+		lat->min = ns;
 	}
+	if ( ns > lat->max ) {
+		lat->max = ns;
+	}
+	lat->last  = ns;
+	lat->sum  += ns;
+	lat->count++;
+	lat->hist[bin]++;
+	spin_unlock( &prg->lock );
+}
 
-	prgd->pdev.id           = mgr->dev.id;
-	prgd->pdev.dev.id       = id;
-	prgd->pdev.dev.release  = release_pdev;
-
-	prgd->mgrNode           = mgrNode;
-
-	/* must 'put' the manager before registering the device
-	 * because this may trigger the driver to be bound which
-	 * then will need the manager. Avoid deadlock by releasing
-	 * here. (The manager can only be held exclusivly.)
-	 */
-	fpga_mgr_put( mgr );
-	mgrPut = 1;
+static void
+stats_since(struct fpga_prog_drvdat *prg, enum fpga_prog_phase phase, ktime_t start)
+{
+	stats_record( prg, phase, ktime_to_ns( ktime_sub( ktime_get(), start ) ) );
+}
 
-	/* If the device can be successfully registered then
-	 * we must not remove this module while it is in use.
-	 */
-	__module_get( THIS_MODULE );
+/* Record the duration of a phase of loading 'src'; also reported
+ * to the requester if it asked for it.
+ */
+static void
+src_since(struct fpga_prog_drvdat *prg, struct fpga_prog_src *src, enum fpga_prog_phase phase, ktime_t start)
+{
+u64 ns = ktime_to_ns( ktime_sub( ktime_get(), start ) );
 
-	stat = platform_device_register( &prgd->pdev );
-	if ( stat ) {
-		module_put( THIS_MODULE );
-		goto bail;
+	stats_record( prg, phase, ns );
+	if ( src->times ) {
+		src->times[phase] = ns;
 	}
+}
 
-	/* After this point 'platform_device_unregister()' should take care
-	 * of the module, mgrNode, id and memory.
-	 */
-
-	mgrNode = 0;
-	mem     =  0;
-	id      = -1;
+/* Lookup a partial image by name; 'mutex' must be held
+ */
+static struct fpga_prog_part *
+part_find(struct fpga_prog_drvdat *prg, const char *name)
+{
+struct fpga_prog_part *part;
 
-	/* Add a property that allows for the user to hot-unplug this device
-	 */
-	if ( (stat = device_create_file( &prgd->pdev.dev, &dev_attr_remove )) ) {
-		platform_device_unregister( &prgd->pdev );
-		goto bail;
+	list_for_each_entry( part, &prg->parts, list ) {
+		if ( ! strcmp( part->name, name ) ) {
+			return part;
+		}
 	}
+	return 0;
+}
 
-bail:
-	if ( ! mgrPut ) {
-		fpga_mgr_put( mgr );
-	}
+static void
+part_free(struct fpga_prog_part *part)
+{
+	list_del( &part->list );
+	kfree( part->name );
+	kfree( part->path );
+	kfree( part );
+}
 
-	if ( id >= 0 ) {
-		ida_simple_remove( &fpga_prog_ida, id );
+/* Add or replace a partial image; 'mutex' must be held
+ */
+static int
+part_set(struct fpga_prog_drvdat *prg, const char *name, const char *path)
+{
+struct fpga_prog_part *part;
+char                  *p;
+
+	if ( ! (p = kstrdup( path, GFP_KERNEL )) ) {
+		return -ENOMEM;
 	}
 
-	if ( mgrNode ) {
-		of_node_put( mgrNode );
+	if ( (part = part_find( prg, name )) ) {
+		kfree( part->path );
+		part->path = p;
+		return 0;
 	}
 
-	if ( mem ) {
-		kfree( mem );
+	if ( ! (part = kzalloc( sizeof(*part), GFP_KERNEL )) || ! (part->name = kstrdup( name, GFP_KERNEL )) ) {
+		kfree( part );
+		kfree( p );
+		return -ENOMEM;
 	}
+	part->path = p;
+	list_add_tail( &part->list, &prg->parts );
 
-	return stat;
+	return 0;
 }
 
-
-/* Create and initialize driver-private data. The ref. to the 'mgrNode' is
- * either consumed by this routine (success) or must be dropped by the caller
- * (failure).
+/* Locate an image for the 'pages' loader: absolute paths are used as
+ * they are, other names are searched in the default directories of the
+ * firmware loader.
+ *
+ * RETURNS: the path (must be freed) or ERR_PTR.
  */
-static struct fpga_prog_drvdat *
-create_drvdat( struct platform_device *pdev, struct device_node *mgrNode )
+static char *
+fw_find(const char *name)
 {
-struct fpga_prog_drvdat *prog;
-struct device           *dev;
-struct device_node      *pnod;
-int                      stat;
-const char              *str;
-u32                      val;
+static const char * const dirs[] = {
+	"/lib/firmware/updates/" UTS_RELEASE,
+	"/lib/firmware/updates",
+	"/lib/firmware/" UTS_RELEASE,
+	"/lib/firmware",
+};
+struct path  pth;
+char        *p;
+int          i;
 
-	if ( (dev = driver_find_device( &fpga_prog_driver.driver, 0, mgrNode, cmp_mgr_node )) ) {
-		put_device( dev );
-		return ERR_PTR(-EEXIST);
+	if ( '/' == name[0] ) {
+		if ( ! (p = kstrdup( name, GFP_KERNEL )) ) {
+			return ERR_PTR( -ENOMEM );
+		}
+		return p;
 	}
 
-	if ( ! ( prog = kzalloc( sizeof(*prog), GFP_KERNEL ) ) ) {
-		return ERR_PTR(-ENOMEM);
+	for ( i = 0; i < ARRAY_SIZE( dirs ); i++ ) {
+		if ( ! (p = kasprintf( GFP_KERNEL, "%s/%s", dirs[i], name )) ) {
+			return ERR_PTR( -ENOMEM );
+		}
+		if ( 0 == kern_path( p, LOOKUP_FOLLOW, &pth ) ) {
+			path_put( &pth );
+			return p;
+		}
+		kfree( p );
 	}
 
-	prog->pdev                            = pdev;
-	prog->mgrNode                         = mgrNode;
-	prog->autoload                        = 1;
-
-	prog->info.flags                      = 0;
-	prog->info.enable_timeout_us          = 1000000;
-	prog->info.disable_timeout_us         = 1000000;
-	prog->info.config_complete_timeout_us = 1000000;
+	return ERR_PTR( -ENOENT );
+}
 
-	if ( (pnod = pdev->dev.of_node) ) {
-		/* try to load parameters from OF */
-		of_node_get( pnod );
+/* Read an image into individual pages (no large contiguous
+ * buffer); decompresses on the fly.
+ */
+static int
+fetch_pages(struct fpga_prog_fetched *fet, const char *path)
+{
+struct file  *f;
+struct kstat  st;
+int           err;
 
-		stat = of_property_read_string( pnod, "file", &str );
-		if ( 0 == stat ) {
-			prog->FW_NAME = kstrdup( str, GFP_KERNEL );
-		} else if ( stat != -EINVAL ) {
-			printk(KERN_WARNING "%s: unable to read 'file' property from OF (%d)\n", drvnam, stat);
-		}
+	f = filp_open( path, O_RDONLY, 0 );
+	if ( IS_ERR( f ) ) {
+		return PTR_ERR( f );
+	}
 
-		stat = of_property_read_u32( pnod, "autoload", &val );
-		if ( 0 == stat ) {
-			prog->autoload = val;
-		} else if ( stat != -EINVAL ) {
-			printk(KERN_WARNING "%s: unable to read 'autload' property from OF (%d)\n", drvnam, stat);
+	if ( 0 == (err = vfs_getattr( &f->f_path, &st, STATX_BASIC_STATS, AT_STATX_SYNC_AS_STAT )) ) {
+		if ( 0 == (err = img_read_image( &fet->img, f, st.size )) ) {
+			fet->src.img    = &fet->img;
+			fet->src.stored = st.size;
 		}
-			
-		of_node_put( pnod );
 	}
 
-	return prog;
+	filp_close( f, 0 );
+
+	return err;
 }
 
-/* Attach to a programmer device (either soft or 'hard', i.e., from device-tree)
- *
- * Call: with refs. to fpga_manager and it's of-node. The 'mgrNode' reference is
- * 'consumed' by this routine, i.e., either stored in the driver-private data or
- * dropped. The ref. to the manager is unchanged.
+/* Fetch an image (from the cache, via the firmware loader or
+ * by reading it into pages)
  */
 static int
-dev_attach(struct platform_device *pdev, struct fpga_manager *mgr, struct device_node *mgrNode)
+fetch_image(struct fpga_prog_drvdat *prg, const char *name, struct fpga_prog_fetched *fet)
 {
-struct fpga_prog_drvdat *drvdat;
-struct fpga_prog_drvdat *mem  = 0;
-int                      stat = 0;
-int                      dev_attr_stat[ N_DEV_ATTRS ];
-int                      i;
-struct kobject          *mgrObj = 0;
+ktime_t t0    = ktime_get();
+char   *found = 0;
+int     err;
 
-	for ( i=0; i<N_DEV_ATTRS; i++ ) {
-		dev_attr_stat[i] = -1;
-	}
+	memset( fet, 0, sizeof(*fet) );
 
-	drvdat = create_drvdat( pdev, mgrNode );
+	if ( FPGA_PROG_LOADER_PAGES == prg->loader ) {
+		/* we resolve relative names ourselves */
+		found = fw_find( name );
+		if ( IS_ERR( found ) ) {
+			return PTR_ERR( found );
+		}
+		name = found;
+	}
 
-	if ( IS_ERR( drvdat ) ) {
-		of_node_put( mgrNode );
-		stat = PTR_ERR( drvdat );
-		goto bail;
+	/* Only absolute paths can be cached; the firmware
+	 * loader resolves relative names.
+	 */
+	if ( cache_max_bytes && '/' == name[0] ) {
+		fet->cent = cache_get( name, prg->bit_swap );
+		if ( IS_ERR( fet->cent ) ) {
+			err       = PTR_ERR( fet->cent );
+			fet->cent = 0;
+			kfree( found );
+			return err;
+		}
 	}
 
-	mem = drvdat;
+	/* Not cached; the last .bit image of this programmer may be it */
+	if ( ! bit_keep_last ) {
+		keep_drop( prg );
+	} else if ( ! fet->cent && '/' == name[0] ) {
+		fet->cent = keep_get( prg, name );
+		if ( IS_ERR( fet->cent ) ) {
+			err       = PTR_ERR( fet->cent );
+			fet->cent = 0;
+			kfree( found );
+			return err;
+		}
+	}
 
-	/* for any error after here the mgrNode is 'put' by release_drvdat */
+	if ( fet->cent ) {
+		/* cached images are converted already */
+		fet->src.img    = &fet->cent->img;
+		fet->src.stored = fet->cent->fsize;
+		memcpy( fet->part, fet->cent->part, sizeof(fet->part) );
+		kfree( found );
+	} else if ( found ) {
+		err = fetch_pages( fet, found );
+		kfree( found );
+		if ( err || (err = bit_convert( &fet->src, &fet->img, prg->bit_swap, fet->part )) < 0 ) {
+			fetched_release( fet );
+			return err;
+		}
+	} else {
+		/* Not cacheable; we fetch the image ourselves (rather than
+		 * having the manager do it) so that we get to see the data.
+		 */
+		if ( (err = request_firmware( &fet->fw, name, &prg->pdev->dev )) ) {
+			fet->fw = 0;
+			return err;
+		}
+		fet->src.stored = fet->fw->size;
+
+		err = img_decompress_buf( &fet->img, fet->fw->data, fet->fw->size );
+		if ( err > 0 ) {
+			/* compressed; we don't need the original anymore */
+			release_firmware( fet->fw );
+			fet->fw        = 0;
+			fet->src.img   = &fet->img;
+		} else if ( 0 == err ) {
+			fet->src.buf   = fet->fw->data;
+			fet->src.count = fet->fw->size;
+		} else {
+			fetched_release( fet );
+			return err;
+		}
+
+		if ( (err = bit_convert( &fet->src, &fet->img, prg->bit_swap, fet->part )) < 0 ) {
+			fetched_release( fet );
+			return err;
+		}
+		if ( ! fet->src.buf && fet->fw ) {
+			/* converted into 'img' */
+			release_firmware( fet->fw );
+			fet->fw = 0;
+		}
+	}
+
+	stats_since( prg, FPGA_PROG_PHASE_FETCH, t0 );
+
+	return 0;
+}
+
+/* Release the resources held by a fetched image
+ */
+static void
+fetched_release(struct fpga_prog_fetched *fet)
+{
+	if ( fet->cent ) {
+		cache_put( fet->cent );
+		fet->cent = 0;
+	}
+
+	if ( fet->fw ) {
+		release_firmware( fet->fw );
+		fet->fw = 0;
+	}
+
+	img_free( &fet->img );
+
+	kfree( fet->name );
+	fet->name = 0;
+}
+
+/* Check the part name from a .bit header against the 'expected_part'
+ * (a prefix; a leading 'xc' is ignored). Images without a part name
+ * cannot be checked and are accepted.
+ */
+static int
+bit_check_part(struct fpga_prog_drvdat *prg, const char *part)
+{
+char        exp[FPGA_PROG_PART_MAX];
+const char *p = exp;
+const char *q = part;
+
+	spin_lock( &prg->lock );
+	memcpy( exp, prg->expected_part, sizeof(exp) );
+	spin_unlock( &prg->lock );
+
+	if ( ! exp[0] || ! part[0] ) {
+		return 0;
+	}
+
+	/* the 'xc' is optional in either name */
+	if ( ! strncasecmp( p, "xc", 2 ) ) {
+		p += 2;
+	}
+	if ( ! strncasecmp( q, "xc", 2 ) ) {
+		q += 2;
+	}
+
+	if ( strncasecmp( q, p, min( strlen( q ), strlen( p ) ) ) ) {
+		printk(KERN_ERR "%s: image is for part '%s' but '%s' is expected\n", drvnam, part, exp);
+		return -ENOEXEC;
+	}
+
+	return 0;
+}
+
+/* Load the firmware named by a job using the fpga_manager; 'name'
+ * refers to a partial image if FPGA_PROG_OPT_PARTIAL is set ('mutex'
+ * must be held). A staged image is used (and dropped once loaded) if
+ * its name matches.
+ */
+static int
+load_fw(struct fpga_prog_drvdat *prg, struct fpga_prog_job *job)
+{
+struct fpga_prog_fetched  tmp;
+struct fpga_prog_fetched *fet;
+struct fpga_prog_part    *part;
+const char               *name = job->name;
+char                     *reg  = 0;
+int                       err;
+
+	if ( (job->opts & FPGA_PROG_OPT_PARTIAL) ) {
+		if ( ! (part = part_find( prg, job->name )) ) {
+			return -ENOENT;
+		}
+		name = part->path;
+	}
+
+	if ( prg->staged && ! strcmp( prg->staged->name, name ) ) {
+		fet = prg->staged;
+	} else {
+		fet = &tmp;
+		if ( (err = fetch_image( prg, name, fet )) ) {
+			return err;
+		}
+	}
+
+	/* fail before touching the hardware */
+	if ( ! (err = bit_check_part( prg, fet->part )) ) {
+		err = load_src( prg, &fet->src, job->opts );
+	}
+
+	if ( fet != prg->staged ) {
+		fetched_release( fet );
+	} else if ( ! err ) {
+		/* the staged image has served its purpose */
+		fetched_release( fet );
+		kfree( fet );
+		prg->staged = 0;
+	}
+
+	if ( ! err ) {
+		/* remember which partial image is loaded; a full
+		 * reconfiguration replaces any partial one.
+		 */
+		if ( (job->opts & FPGA_PROG_OPT_PARTIAL) ) {
+			swap( reg, job->name );
+		}
+		spin_lock( &prg->lock );
+		swap( reg, prg->region );
+		spin_unlock( &prg->lock );
+		kfree( reg );
+	}
+
+	return err;
+}
+
+/* Update the programming state and notify
+ * anybody who is poll()ing the 'state' attribute
+ */
+static void
+set_state(struct fpga_prog_drvdat *prg, enum fpga_prog_state state, int err)
+{
+	spin_lock( &prg->lock );
+	prg->state = state;
+	prg->err   = err;
+	spin_unlock( &prg->lock );
+
+	sysfs_notify( &prg->pdev->dev.kobj, 0, "state" );
+}
+
+/* Publish the outcome of a load. If another request was submitted
+ * in the meantime then it is going to be executed next and the
+ * state is 'queued' rather than 'done' or 'error'.
+ * RETURNS: nonzero if a request is pending.
+ */
+static int
+set_result(struct fpga_prog_drvdat *prg, int err)
+{
+int pending;
+
+	spin_lock( &prg->lock );
+	pending = ( 0 != prg->pend );
+	if ( pending ) {
+		prg->state = FPGA_PROG_QUEUED;
+		prg->err   = 0;
+	} else {
+		prg->state = err ? FPGA_PROG_ERROR : FPGA_PROG_DONE;
+		prg->err   = err;
+	}
+	spin_unlock( &prg->lock );
+
+	sysfs_notify( &prg->pdev->dev.kobj, 0, "state" );
+
+	return pending;
+}
+
+/* Emit a KOBJ_CHANGE uevent on the programmer device:
+ *
+ *   FPGA_PROG_EVENT=start|done|error
+ *   FPGA_PROG_IMAGE=<name>         (not for images from the character device etc.)
+ *   FPGA_PROG_PARTIAL=1            (partial image)
+ *   FPGA_PROG_DURATION_US=<us>     (done, error)
+ *   FPGA_PROG_ERRNO=<errno>        (error)
+ *   FPGA_PROG_PENDING=1            (done, error; another request executes next)
+ */
+static void
+prog_uevent(struct fpga_prog_drvdat *prg, const char *event, const char *img, int partial, s64 dur_us, int err, int pending)
+{
+char  ev [32];
+char  dur[48];
+char  eno[32];
+char *envp[7];
+int   n = 0;
+
+	snprintf( ev, sizeof(ev), "FPGA_PROG_EVENT=%s", event );
+	envp[n++] = ev;
+	if ( img ) {
+		envp[n++] = (char*)img;
+	}
+	if ( partial ) {
+		envp[n++] = "FPGA_PROG_PARTIAL=1";
+	}
+	if ( dur_us >= 0 ) {
+		snprintf( dur, sizeof(dur), "FPGA_PROG_DURATION_US=%lld", (long long)dur_us );
+		envp[n++] = dur;
+	}
+	if ( err ) {
+		snprintf( eno, sizeof(eno), "FPGA_PROG_ERRNO=%d", -err );
+		envp[n++] = eno;
+	}
+	if ( pending ) {
+		envp[n++] = "FPGA_PROG_PENDING=1";
+	}
+	envp[n] = 0;
+
+	kobject_uevent_env( &prg->pdev->dev.kobj, KOBJ_CHANGE, envp );
+}
+
+/* Driver-wide load scheduler: at most 'max_concurrent_loads' programmers
+ * access their device at the same time. Others wait in 'sched_queue'
+ * (highest priority first, FIFO among equal priorities) until a running
+ * load completes. Lock order: 'prg->lock' before 'sched_lock'.
+ */
+struct fpga_prog_slot {
+	struct list_head        list;
+	int                     prio;
+	int                     err;
+	struct completion       done;
+};
+
+static DEFINE_SPINLOCK( sched_lock );
+static LIST_HEAD( sched_queue );
+static unsigned int sched_running;
+static unsigned int sched_queued;
+static u64          sched_waits;
+static u64          sched_wait_ns;
+static u64          sched_wait_max_ns;
+
+/* Admit waiting loads as long as the limit permits; 'sched_lock' must be held
+ */
+static void
+sched_grant(void)
+{
+struct fpga_prog_slot *slot;
+unsigned int           max = READ_ONCE( max_concurrent_loads );
+
+	while ( ! list_empty( &sched_queue ) && ( 0 == max || sched_running < max ) ) {
+		slot = list_first_entry( &sched_queue, struct fpga_prog_slot, list );
+		list_del_init( &slot->list );
+		sched_queued--;
+		sched_running++;
+		slot->err = 0;
+		complete( &slot->done );
+	}
+}
+
+static void
+sched_kick(void)
+{
+	spin_lock( &sched_lock );
+	sched_grant();
+	spin_unlock( &sched_lock );
+}
+
+/* Wait for permission to load the device; must be followed by
+ * sched_release() if successful.
+ *
+ * RETURNS: 0 or -ECANCELED (see sched_cancel()), -ENODEV (detached).
+ */
+static int
+sched_acquire(struct fpga_prog_drvdat *prg, struct fpga_prog_slot *slot, int prio)
+{
+struct fpga_prog_slot *pos;
+ktime_t                t0 = ktime_get();
+u64                    ns;
+
+	slot->prio = prio;
+	slot->err  = -EINPROGRESS;
+	init_completion( &slot->done );
+
+	spin_lock( &prg->lock );
+	if ( prg->detached ) {
+		spin_unlock( &prg->lock );
+		return -ENODEV;
+	}
+	prg->slot = slot;
+
+	spin_lock( &sched_lock );
+	list_for_each_entry( pos, &sched_queue, list ) {
+		if ( pos->prio < prio ) {
+			break;
+		}
+	}
+	/* before 'pos' (or at the tail) */
+	list_add_tail( &slot->list, &pos->list );
+	sched_queued++;
+	sched_grant();
+	spin_unlock( &sched_lock );
+
+	spin_unlock( &prg->lock );
+
+	wait_for_completion( &slot->done );
+
+	/* sched_cancel() holds 'lock' while it uses the slot */
+	spin_lock( &prg->lock );
+	prg->slot = 0;
+	spin_unlock( &prg->lock );
+
+	ns = ktime_to_ns( ktime_sub( ktime_get(), t0 ) );
+
+	spin_lock( &sched_lock );
+	sched_waits++;
+	sched_wait_ns += ns;
+	if ( ns > sched_wait_max_ns ) {
+		sched_wait_max_ns = ns;
+	}
+	spin_unlock( &sched_lock );
+
+	return slot->err;
+}
+
+static void
+sched_release(void)
+{
+	spin_lock( &sched_lock );
+	sched_running--;
+	sched_grant();
+	spin_unlock( &sched_lock );
+}
+
+/* Cancel a load of 'prg' which waits for its turn (it fails with -ECANCELED)
+ *
+ * RETURNS: nonzero if a load was cancelled.
+ */
+static int
+sched_cancel(struct fpga_prog_drvdat *prg)
+{
+struct fpga_prog_slot *slot;
+int                    rval = 0;
+
+	spin_lock( &prg->lock );
+	if ( (slot = prg->slot) ) {
+		spin_lock( &sched_lock );
+		if ( ! list_empty( &slot->list ) ) {
+			list_del_init( &slot->list );
+			sched_queued--;
+			slot->err = -ECANCELED;
+			complete( &slot->done );
+			rval = 1;
+		}
+		spin_unlock( &sched_lock );
+	}
+	spin_unlock( &prg->lock );
+
+	return rval;
+}
+
+/* Execute a programming job and update the state accordingly.
+ */
+static int
+run_job(struct fpga_prog_drvdat *prg, struct fpga_prog_job *job)
+{
+struct fpga_prog_slot slot;
+ktime_t               t0;
+s64                   dur;
+char                 *img     = 0;
+int                   partial = !! (job->opts & FPGA_PROG_OPT_PARTIAL);
+int                   pending;
+int                   err;
+
+	/* load_fw() may consume the name */
+	if ( job->name ) {
+		img = kasprintf( GFP_KERNEL, "FPGA_PROG_IMAGE=%s", job->name );
+	}
+
+	/* Wait for our turn (see 'max_concurrent_loads'; may be cancelled)
+	 * before taking 'mutex' and the manager so that neither is held
+	 * while other programmers are loading. The slot covers fetching
+	 * the image, too.
+	 */
+	t0  = ktime_get();
+
+	if ( (err = sched_acquire( prg, &slot, job->prio )) ) {
+		pending = set_result( prg, err );
+		prog_uevent( prg, "error", img, partial, -1, err, pending );
+		kfree( img );
+		return err;
+	}
+
+	if ( job->src ) {
+		src_since( prg, job->src, FPGA_PROG_PHASE_WAIT, t0 );
+	} else {
+		stats_since( prg, FPGA_PROG_PHASE_WAIT, t0 );
+	}
+
+	mutex_lock( &prg->mutex );
+
+	set_state( prg, FPGA_PROG_LOADING, 0 );
+	prog_uevent( prg, "start", img, partial, -1, 0, 0 );
+
+	t0  = ktime_get();
+
+	err = job->src ? load_src( prg, job->src, job->opts ) : load_fw( prg, job );
+
+	dur = ktime_to_us( ktime_sub( ktime_get(), t0 ) );
+
+	if ( ! err ) {
+		if ( job->src ) {
+			src_since( prg, job->src, FPGA_PROG_PHASE_TOTAL, t0 );
+		} else {
+			stats_since( prg, FPGA_PROG_PHASE_TOTAL, t0 );
+		}
+	}
+
+	pending = set_result( prg, err );
+	prog_uevent( prg, err ? "error" : "done", img, partial, dur, err, pending );
+
+	mutex_unlock( &prg->mutex );
+
+	sched_release();
+
+	kfree( img );
+
+	return err;
+}
+
+/* Report the status of a job to the requester (or free it)
+ */
+static void
+job_finish(struct fpga_prog_job *job, int err)
+{
+	kfree( job->name );
+	job->name = 0;
+	job->err  = err;
+	if ( job->done ) {
+		/* 'job' may be gone once the requester wakes up */
+		complete( job->done );
+	} else {
+		kfree( job );
+	}
+}
+
+/* Execute pending jobs
+ */
+static void
+load_work(struct work_struct *work)
+{
+struct fpga_prog_drvdat *prg = container_of( work, struct fpga_prog_drvdat, work );
+struct fpga_prog_job    *job;
+int                      err;
+
+	for (;;) {
+		spin_lock( &prg->lock );
+		job       = prg->pend;
+		prg->pend = 0;
+		spin_unlock( &prg->lock );
+
+		if ( ! job ) {
+			break;
+		}
+
+		if ( (err = run_job( prg, job )) && ! job->done ) {
+			printk(KERN_WARNING "%s: programming firmware failed (%d)\n", drvnam, err);
+		}
+
+		job_finish( job, err );
+	}
+}
+
+/* Submit a job. A job that is still pending is superseded (and fails
+ * with -ESTALE), i.e., requests arriving while a load is in progress
+ * are coalesced and only the most recent one is executed.
+ */
+static void
+submit_job(struct fpga_prog_drvdat *prg, struct fpga_prog_job *job)
+{
+struct fpga_prog_job *old;
+int                   notify = 0;
+
+	spin_lock( &prg->lock );
+	if ( prg->detached ) {
+		spin_unlock( &prg->lock );
+		job_finish( job, -ENODEV );
+		return;
+	}
+	old       = prg->pend;
+	prg->pend = job;
+	/* a running load keeps reporting 'loading' */
+	if ( FPGA_PROG_LOADING != prg->state ) {
+		prg->state = FPGA_PROG_QUEUED;
+		prg->err   = 0;
+		notify     = 1;
+	}
+	spin_unlock( &prg->lock );
+
+	if ( notify ) {
+		sysfs_notify( &prg->pdev->dev.kobj, 0, "state" );
+	}
+
+	if ( old ) {
+		job_finish( old, -ESTALE );
+	}
+
+	queue_work( fpga_prog_wq, &prg->work );
+}
+
+/* Request programming from 'src' or (if NULL) the image 'name' (which
+ * is consumed). Unless 'wait' is set the job is merely queued and the
+ * result must be obtained from 'state' ('src' requires 'wait').
+ *
+ * RETURNS: status of the job (-ESTALE if superseded by a newer request).
+ */
+static int
+request_load(struct fpga_prog_drvdat *prg, char *name, struct fpga_prog_src *src, unsigned opts, int wait)
+{
+DECLARE_COMPLETION_ONSTACK( done );
+struct fpga_prog_job  sjob = { 0 };
+struct fpga_prog_job *job  = &sjob;
+
+	if ( ! src && ! name ) {
+		return -EINVAL;
+	}
+
+	if ( wait ) {
+		job->done = &done;
+	} else if ( ! (job = kzalloc( sizeof(*job), GFP_KERNEL )) ) {
+		kfree( name );
+		return -ENOMEM;
+	}
+
+	job->name = name;
+	job->src  = src;
+	job->opts = opts;
+	job->prio = (opts & FPGA_PROG_OPT_URGENT) ? FPGA_PROG_PRIO_URGENT : READ_ONCE( prg->priority );
+
+	submit_job( prg, job );
+
+	if ( ! wait ) {
+		return 0;
+	}
+
+	wait_for_completion( &done );
+
+	return sjob.err;
+}
+
+/* Stop executing jobs; pending ones fail, a running
+ * one is waited for.
+ */
+static void
+jobs_shutdown(struct fpga_prog_drvdat *prg)
+{
+struct fpga_prog_job *job;
+
+	spin_lock( &prg->lock );
+	prg->detached = 1;
+	job           = prg->pend;
+	prg->pend     = 0;
+	spin_unlock( &prg->lock );
+
+	if ( job ) {
+		job_finish( job, -ENODEV );
+	}
+
+	/* a load waiting for its turn gives up */
+	sched_cancel( prg );
+
+	cancel_work_sync( &prg->work );
+}
+
+/* Copy the firmware name
+ *
+ * RETURNS: copy (NULL if no name is set) or error encoded in the pointer.
+ */
+static char *
+fw_name_dup(struct fpga_prog_drvdat *prg)
+{
+char *nam = 0;
+
+	mutex_lock( &prg->name_mutex );
+	if ( prg->FW_NAME && ! (nam = kstrdup( prg->FW_NAME, GFP_KERNEL )) ) {
+		nam = ERR_PTR( -ENOMEM );
+	}
+	mutex_unlock( &prg->name_mutex );
+
+	return nam;
+}
+
+/* Replace the firmware name ('name' is consumed)
+ */
+static void
+fw_name_set(struct fpga_prog_drvdat *prg, char *name)
+{
+	mutex_lock( &prg->name_mutex );
+	swap( name, prg->FW_NAME );
+	mutex_unlock( &prg->name_mutex );
+
+	kfree( name );
+}
+
+/* Inline digest: the image is hashed while it is filled (read, copied
+ * or decompressed) so that the data need not be traversed again.
+ * Start hashing an (empty) image; without a tfm or memory we
+ * silently fall back to hashing the data when loading.
+ */
+static void
+img_hash_start(struct fpga_prog_img *img)
+{
+struct shash_desc *desc;
+
+	img->digest_valid = 0;
+
+	if ( ! digest_tfm || img->hash ) {
+		return;
+	}
+
+	if ( ! (desc = kmalloc( sizeof(*desc) + crypto_shash_descsize( digest_tfm ), GFP_KERNEL )) ) {
+		return;
+	}
+	desc->tfm = digest_tfm;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,2,0)
+	desc->flags = 0;
+#endif
+	if ( crypto_shash_init( desc ) ) {
+		kfree( desc );
+		return;
+	}
+	img->hash = desc;
+}
+
+static void
+img_hash_abort(struct fpga_prog_img *img)
+{
+	if ( img->hash ) {
+		shash_desc_zero( img->hash );
+		kfree( img->hash );
+		img->hash = 0;
+	}
+}
+
+/* Hash data as they are added to the image
+ */
+static void
+img_hash_update(struct fpga_prog_img *img, const void *data, size_t len)
+{
+	if ( img->hash && crypto_shash_update( img->hash, data, len ) ) {
+		img_hash_abort( img );
+	}
+}
+
+/* All data have been added; the digest becomes valid
+ */
+static void
+img_hash_final(struct fpga_prog_img *img)
+{
+	if ( img->hash ) {
+		img->digest_valid = ( 0 == crypto_shash_final( img->hash, img->digest ) );
+		img_hash_abort( img );
+	}
+}
+
+/* Release the pages of an image
+ */
+static void
+img_free(struct fpga_prog_img *img)
+{
+unsigned int i;
+
+	for ( i=0; i<img->npages; i++ ) {
+		put_page( img->pages[i] );
+	}
+	kvfree( img->pages );
+
+	img_hash_abort( img );
+
+	img->pages    = 0;
+	img->npages   = 0;
+	img->maxpages = 0;
+	img->off      = 0;
+	img->size     = 0;
+	img->digest_valid = 0;
+}
+
+/* Make sure an image has enough pages to hold 'size' bytes
+ */
+static int
+img_grow(struct fpga_prog_img *img, size_t size)
+{
+unsigned int   need = DIV_ROUND_UP( size, PAGE_SIZE );
+unsigned int   max;
+struct page  **pages;
+struct page   *pg;
+
+	if ( size > max_image_size ) {
+		return -EFBIG;
+	}
+
+	if ( need > img->maxpages ) {
+		/* grow the page array geometrically */
+		max = max( need, 2*img->maxpages );
+		if ( ! (pages = kvmalloc_array( max, sizeof(*pages), GFP_KERNEL )) ) {
+			return -ENOMEM;
+		}
+		if ( img->npages ) {
+			memcpy( pages, img->pages, img->npages * sizeof(*pages) );
+		}
+		kvfree( img->pages );
+		img->pages    = pages;
+		img->maxpages = max;
+	}
+
+	while ( img->npages < need ) {
+		if ( ! (pg = alloc_page( GFP_KERNEL | __GFP_NOWARN )) ) {
+			return -ENOMEM;
+		}
+		img->pages[ img->npages++ ] = pg;
+	}
+
+	return 0;
+}
+
+/* Append data from userspace to an image
+ */
+static ssize_t
+img_write_user(struct fpga_prog_img *img, const char __user *ubuf, size_t len)
+{
+size_t  done = 0;
+size_t  off, chunk;
+void   *va;
+int     err;
+
+	if ( (err = img_grow( img, img->size + len )) ) {
+		return err;
+	}
+
+	while ( done < len ) {
+		off   = offset_in_page( img->size );
+		chunk = min_t( size_t, len - done, PAGE_SIZE - off );
+		va    = kmap( img->pages[ img->size >> PAGE_SHIFT ] );
+		err   = copy_from_user( va + off, ubuf + done, chunk );
+		if ( ! err ) {
+			img_hash_update( img, va + off, chunk );
+		}
+		kunmap( img->pages[ img->size >> PAGE_SHIFT ] );
+		if ( err ) {
+			return done ? done : -EFAULT;
+		}
+		img->size += chunk;
+		done      += chunk;
+	}
+
+	return done;
+}
+
+/* Hand a sg_table to the manager. We use a copy of the 'info'
+ * so that the firmware name is left alone; 'flags' are added
+ * to the info flags.
+ */
+static int
+mgr_load_sgt(struct fpga_prog_drvdat *prg, struct fpga_manager *mgr, struct sg_table *sgt, u32 flags)
+{
+struct fpga_image_info info = prg->info;
+
+	info.flags |= flags;
+
+#if defined(HAS_NEW_API)
+	info.firmware_name = 0;
+	info.sgt           = sgt;
+	return fpga_mgr_load( mgr, &info );
+#else
+	return fpga_mgr_buf_load_sg( mgr, &info, sgt );
+#endif
+}
+
+/* Hand a contiguous buffer to the manager
+ */
+static int
+mgr_load_buf(struct fpga_prog_drvdat *prg, struct fpga_manager *mgr, const void *buf, size_t count, u32 flags)
+{
+struct fpga_image_info info = prg->info;
+
+	info.flags |= flags;
+
+#if defined(HAS_NEW_API)
+	info.firmware_name = 0;
+	info.buf           = buf;
+	info.count         = count;
+	return fpga_mgr_load( mgr, &info );
+#else
+	return fpga_mgr_buf_load( mgr, &info, buf, count );
+#endif
+}
+
+/* Map the pages of an image into a sg_table
+ */
+static int
+img_map_sgt(struct fpga_prog_img *img, struct sg_table *sgt)
+{
+unsigned int first = img->off >> PAGE_SHIFT;
+size_t       off   = offset_in_page( img->off );
+
+	return sg_alloc_table_from_pages( sgt, img->pages + first, DIV_ROUND_UP( off + img->size, PAGE_SIZE ), off, img->size, GFP_KERNEL );
+}
+
+/* Compute the digest of an image
+ */
+static int
+src_digest_tfm(struct crypto_shash *tfm, struct fpga_prog_src *src, u8 *digest)
+{
+SHASH_DESC_ON_STACK( desc, tfm );
+struct fpga_prog_img *img = src->img;
+size_t                pos, off, chunk;
+struct page          *pg;
+void                 *va;
+int                   err;
+
+	desc->tfm = tfm;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,2,0)
+	desc->flags = 0;
+#endif
+
+	if ( (err = crypto_shash_init( desc )) ) {
+		return err;
+	}
+
+	for ( pos = 0; pos < (img ? img->size : src->count); pos += chunk ) {
+		if ( img ) {
+			off   = offset_in_page( img->off + pos );
+			chunk = min_t( size_t, img->size - pos, PAGE_SIZE - off );
+			pg    = img->pages[ (img->off + pos) >> PAGE_SHIFT ];
+			va    = kmap( pg );
+			err   = crypto_shash_update( desc, va + off, chunk );
+			kunmap( pg );
+		} else {
+			chunk = min_t( size_t, src->count - pos, 1 << 16 );
+			err   = crypto_shash_update( desc, src->buf + pos, chunk );
+		}
+		if ( err ) {
+			return err;
+		}
+		cond_resched();
+	}
+
+	err = crypto_shash_final( desc, digest );
+
+	shash_desc_zero( desc );
+
+	return err;
+}
+
+static int
+src_digest(struct fpga_prog_src *src, u8 *digest)
+{
+	if ( ! digest_tfm ) {
+		return -ENOENT;
+	}
+
+	return src_digest_tfm( digest_tfm, src, digest );
+}
+
+/* Check if the image with 'digest' is still loaded
+ */
+static int
+is_loaded(struct fpga_prog_drvdat *prg, struct fpga_manager *mgr, const u8 *digest)
+{
+int rval;
+
+	if ( FPGA_MGR_STATE_OPERATING != mgr->state ) {
+		return 0;
+	}
+
+	spin_lock( &prg->lock );
+	rval = prg->digest_valid && ! memcmp( prg->digest, digest, FPGA_PROG_DIGEST_SIZE );
+	spin_unlock( &prg->lock );
+
+	return rval;
+}
+
+/* Parse an 'autoload' setting: "if-unconfigured" or a number
+ *
+ * RETURNS: 0 or -EINVAL ('*val' unchanged).
+ */
+static int
+autoload_parse(const char *str, int *val)
+{
+int v;
+
+	if ( sysfs_streq( str, "if-unconfigured" ) ) {
+		*val = FPGA_PROG_AUTOLOAD_IF_UNCONFIGURED;
+		return 0;
+	}
+	if ( kstrtoint( str, 0, &v ) ) {
+		return -EINVAL;
+	}
+	*val = v ? FPGA_PROG_AUTOLOAD_ON : FPGA_PROG_AUTOLOAD_OFF;
+	return 0;
+}
+
+/* Digest of the image loaded by the bootloader: optional property
+ * 'fpga-prog,<device>-digest' of /chosen (32 bytes or a hex string)
+ *
+ * RETURNS: 0 or -ENOENT (no such property), other negative errno.
+ */
+static int
+boot_digest(struct fpga_prog_drvdat *prg, u8 *digest)
+{
+struct device_node *chosen;
+const char         *val;
+char               *prop;
+int                 len;
+int                 err = -ENOENT;
+
+	if ( ! (chosen = of_find_node_by_path( "/chosen" )) ) {
+		return -ENOENT;
+	}
+
+	if ( ! (prop = kasprintf( GFP_KERNEL, "fpga-prog,%s-digest", dev_name( &prg->pdev->dev ) )) ) {
+		of_node_put( chosen );
+		return -ENOMEM;
+	}
+
+	if ( (val = of_get_property( chosen, prop, &len )) ) {
+		if ( FPGA_PROG_DIGEST_SIZE == len ) {
+			memcpy( digest, val, FPGA_PROG_DIGEST_SIZE );
+			err = 0;
+		} else if ( 2*FPGA_PROG_DIGEST_SIZE + 1 == len && 0 == hex2bin( digest, val, FPGA_PROG_DIGEST_SIZE ) ) {
+			err = 0;
+		} else {
+			printk(KERN_WARNING "%s: ignoring malformed '%s' in /chosen\n", drvnam, prop);
+			err = -EINVAL;
+		}
+	}
+
+	kfree( prop );
+	of_node_put( chosen );
+
+	return err;
+}
+
+/* 'autoload = if-unconfigured': check whether the bootloader has configured
+ * the FPGA already ('state' is the manager's state). If it passed the digest
+ * of the image then this is recorded as the loaded image and FPGA_PROG_OPT_IDENTICAL
+ * is set in '*opts', i.e., the autoload job fetches our image but only programs it
+ * if it differs.
+ *
+ * RETURNS: nonzero if autoload must be skipped altogether.
+ */
+static int
+boot_configured(struct fpga_prog_drvdat *prg, enum fpga_mgr_states state, unsigned *opts)
+{
+u8 digest[FPGA_PROG_DIGEST_SIZE];
+
+	if ( FPGA_MGR_STATE_OPERATING != state ) {
+		return 0;
+	}
+
+	if ( boot_digest( prg, digest ) ) {
+		return 1;
+	}
+
+	spin_lock( &prg->lock );
+	memcpy( prg->digest, digest, FPGA_PROG_DIGEST_SIZE );
+	prg->digest_valid = 1;
+	spin_unlock( &prg->lock );
+
+	*opts |= FPGA_PROG_OPT_IDENTICAL;
+
+	return 0;
+}
+
+/* Create the devices implemented by the fabric (children of the
+ * 'fabric' node) once an image has been loaded ('mutex' held)
+ */
+static void
+fabric_populate(struct fpga_prog_drvdat *prg)
+{
+int err;
+
+	if ( ! prg->fabric || prg->fabric_populated ) {
+		return;
+	}
+
+	/* nested buses (e.g., 'simple-bus') are populated, too */
+	if ( (err = of_platform_populate( prg->fabric, of_default_bus_match_table, 0, &prg->pdev->dev )) ) {
+		printk(KERN_WARNING "%s: populating fabric devices failed (%d)\n", drvnam, err);
+		/* some may have been created */
+	}
+	prg->fabric_populated = 1;
+}
+
+/* Remove the devices implemented by the fabric before it goes away
+ * ('mutex' held)
+ */
+static void
+fabric_depopulate(struct fpga_prog_drvdat *prg)
+{
+	if ( prg->fabric_populated ) {
+		/* of_platform_depopulate( &prg->pdev->dev ) would look for
+		 * OF_POPULATED_BUS on our own node but of_platform_populate()
+		 * set it on the fabric node; destroy the children ourselves.
+		 */
+		device_for_each_child_reverse( &prg->pdev->dev, 0, of_platform_device_destroy );
+		of_node_clear_flag( prg->fabric, OF_POPULATED_BUS );
+		prg->fabric_populated = 0;
+	}
+}
+
+static int
+load_src(struct fpga_prog_drvdat *prg, struct fpga_prog_src *src, unsigned opts)
+{
+struct fpga_manager *mgr;
+struct sg_table      sgt;
+u8                   digest[FPGA_PROG_DIGEST_SIZE];
+int                  have_digest;
+u32                  flags = (opts & FPGA_PROG_OPT_PARTIAL) ? FPGA_MGR_PARTIAL_RECONFIG : 0;
+ktime_t              t0;
+int                  partial;
+int                  err;
+
+	if ( src->img ? ! src->img->size : ! src->count ) {
+		return -EINVAL;
+	}
+
+	if ( src->img && src->img->digest_valid ) {
+		/* computed while the image was read */
+		memcpy( digest, src->img->digest, FPGA_PROG_DIGEST_SIZE );
+		have_digest = 1;
+	} else if ( audit_digest || prg->skip_identical || (opts & FPGA_PROG_OPT_IDENTICAL) ) {
+		/* costs another pass over the image */
+		have_digest = ( 0 == src_digest( src, digest ) );
+	} else {
+		have_digest = 0;
+	}
+
+	t0  = ktime_get();
+
+	mgr = mref_get_mgr( &prg->mref );
+
+	trace_fpga_prog_mgr_get( &prg->pdev->dev, IS_ERR( mgr ) ? PTR_ERR( mgr ) : 0 );
+
+	if ( IS_ERR( mgr ) ) {
+		return PTR_ERR( mgr );
+	}
+
+	src_since( prg, src, FPGA_PROG_PHASE_ACQUIRE, t0 );
+
+	if (    ( prg->skip_identical || (opts & FPGA_PROG_OPT_IDENTICAL) )
+	     && ! (opts & FPGA_PROG_OPT_FORCE)
+	     && have_digest
+	     && is_loaded( prg, mgr, digest ) ) {
+		printk(KERN_INFO "%s: identical image already loaded; not reprogramming\n", drvnam);
+		fpga_mgr_put( mgr );
+		trace_fpga_prog_mgr_put( &prg->pdev->dev );
+		fabric_populate( prg );
+		return 0;
+	}
+
+	/* A partial image leaves the static part (and the devices
+	 * implemented there) alone.
+	 */
+	partial = !! ( (flags | prg->info.flags) & FPGA_MGR_PARTIAL_RECONFIG );
+
+	if ( ! partial ) {
+		fabric_depopulate( prg );
+	}
+
+	trace_fpga_prog_load_start( &prg->pdev->dev, src->img ? src->img->size : src->count );
+
+	t0  = ktime_get();
+
+	if ( src->img ) {
+		if ( 0 == (err = img_map_sgt( src->img, &sgt )) ) {
+			err = mgr_load_sgt( prg, mgr, &sgt, flags );
+			sg_free_table( &sgt );
+		}
+	} else {
+		err = mgr_load_buf( prg, mgr, src->buf, src->count, flags );
+	}
+
+	if ( ! err ) {
+		src_since( prg, src, FPGA_PROG_PHASE_LOAD, t0 );
+
+		spin_lock( &prg->lock );
+		prg->last_loaded = src->img ? src->img->size : src->count;
+		prg->last_stored = src->stored ? src->stored : prg->last_loaded;
+		prg->last_time_ns      = ktime_get_real_ns();
+		prg->last_digest_valid = have_digest;
+		memcpy( prg->last_digest, digest, FPGA_PROG_DIGEST_SIZE );
+		spin_unlock( &prg->lock );
+	}
+
+	trace_fpga_prog_load_end( &prg->pdev->dev, src->img ? src->img->size : src->count, err );
+
+	fpga_mgr_put( mgr );
+
+	trace_fpga_prog_mgr_put( &prg->pdev->dev );
+
+	if ( ! err && ! partial ) {
+		fabric_populate( prg );
+	}
+
+	spin_lock( &prg->lock );
+	prg->digest_valid = ( 0 == err && have_digest );
+	if ( prg->digest_valid ) {
+		memcpy( prg->digest, digest, FPGA_PROG_DIGEST_SIZE );
+	}
+	spin_unlock( &prg->lock );
+
+	return err;
+}
+
+/* Read from a file
+ */
+static ssize_t
+file_read(struct file *f, void *buf, size_t count, loff_t *pos)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,14,0)
+ssize_t rval = kernel_read( f, *pos, buf, count );
+
+	if ( rval > 0 ) {
+		*pos += rval;
+	}
+	return rval;
+#else
+	return kernel_read( f, buf, count, pos );
+#endif
+}
+
+/* Read 'size' bytes of a file into a page-backed image
+ */
+static int
+img_read_file(struct fpga_prog_img *img, struct file *f, loff_t size)
+{
+loff_t   pos = 0;
+size_t   off, chunk;
+ssize_t  got;
+void    *va;
+int      err;
+
+	if ( (err = img_grow( img, size )) ) {
+		return err;
+	}
+
+	while ( img->size < size ) {
+		off   = offset_in_page( img->size );
+		chunk = min_t( loff_t, size - img->size, PAGE_SIZE - off );
+		va    = kmap( img->pages[ img->size >> PAGE_SHIFT ] );
+		got   = file_read( f, va + off, chunk, &pos );
+		if ( got > 0 ) {
+			img_hash_update( img, va + off, got );
+		}
+		kunmap( img->pages[ img->size >> PAGE_SHIFT ] );
+		if ( got < 0 ) {
+			return got;
+		}
+		if ( 0 == got ) {
+			/* file was truncated under our feet */
+			return -EIO;
+		}
+		img->size += got;
+	}
+
+	return 0;
+}
+
+/* Decompression
+ *
+ * The decompressors consume the image sequentially from a file
+ * (read in chunks through a bounce buffer) or from a buffer in
+ * memory and write directly into the pages of an image.
+ */
+#define FPGA_PROG_IN_CHUNK (64*1024)
+
+struct fpga_prog_in {
+	struct file            *f;
+	const u8               *buf;
+	loff_t                  size;
+	loff_t                  pos;
+	u8                     *chunk;
+	/* current window */
+	const u8               *ptr;
+	size_t                  len;
+	size_t                  used;
+};
+
+/* Make sure there is input in the window (unless at EOF)
+ */
+static int
+in_fill(struct fpga_prog_in *in)
+{
+ssize_t got;
+
+	if ( in->used < in->len || in->pos >= in->size ) {
+		return 0;
+	}
+
+	if ( ! in->f ) {
+		in->ptr = in->buf + in->pos;
+		in->len = in->size - in->pos;
+		in->pos = in->size;
+	} else {
+		got = file_read( in->f, in->chunk, min_t( loff_t, FPGA_PROG_IN_CHUNK, in->size - in->pos ), &in->pos );
+		if ( got <= 0 ) {
+			return got ? got : -EIO;
+		}
+		in->ptr = in->chunk;
+		in->len = got;
+	}
+	in->used = 0;
+
+	return 0;
+}
+
+/* Make sure there are at least 'need' bytes in the window (unless at EOF);
+ * the rest of the window is moved to the front of the bounce buffer.
+ */
+static int
+in_need(struct fpga_prog_in *in, size_t need)
+{
+size_t  left = in->len - in->used;
+ssize_t got;
+
+	if ( left >= need || in->pos >= in->size || ! in->f ) {
+		return 0;
+	}
+
+	memmove( in->chunk, in->ptr + in->used, left );
+	in->ptr  = in->chunk;
+	in->len  = left;
+	in->used = 0;
+
+	while ( in->len < need && in->pos < in->size ) {
+		got = file_read( in->f, in->chunk + in->len, min_t( loff_t, FPGA_PROG_IN_CHUNK - in->len, in->size - in->pos ), &in->pos );
+		if ( got <= 0 ) {
+			return got ? got : -EIO;
+		}
+		in->len += got;
+	}
+
+	return 0;
+}
+
+struct fpga_prog_dec {
+	void                   *priv;
+	void                   *wksp;
+};
+
+struct fpga_prog_dec_ops {
+	const char             *name;
+	const u8               *magic;
+	size_t                  magic_len;
+	/* 'hdr' is the input window at the start of a stream (gzip member, zstd frame);
+	 * the decompressor may consume a header
+	 */
+	int                   (*init)(struct fpga_prog_dec *dec, const u8 *hdr, size_t len, size_t *used);
+	/* RETURNS: 1 at the end of the stream (including any trailer), 0 if more data
+	 *          are expected, negative on error
+	 */
+	int                   (*run)(struct fpga_prog_dec *dec, const u8 *in, size_t *in_pos, size_t in_len, u8 *out, size_t *out_pos, size_t out_len);
+	void                  (*fini)(struct fpga_prog_dec *dec);
+};
+
+#if IS_ENABLED(CONFIG_ZLIB_INFLATE)
+static const u8 gz_magic[] = { 0x1f, 0x8b };
+
+/* The kernel's zlib does not handle the gzip wrapper; skip the
+ * header (RFC 1952), inflate the raw deflate stream and check the
+ * trailer (CRC32 and ISIZE) ourselves.
+ */
+struct fpga_prog_gz {
+	z_stream                strm;
+	u32                     crc;
+	u32                     isize;
+	int                     end;
+	/* trailer; may be split across input windows */
+	u8                      trl[8];
+	size_t                  ntrl;
+};
+
+static int
+gz_init(struct fpga_prog_dec *dec, const u8 *hdr, size_t len, size_t *used)
+{
+struct fpga_prog_gz *gz;
+z_stream            *strm;
+size_t               pos = 10;
+u8                   flg;
+
+	if ( len < pos || 8 != hdr[2] ) {
+		return -EINVAL;
+	}
+	flg = hdr[3];
+	if ( (flg & 0x04) ) {                /* FEXTRA   */
+		if ( pos + 2 > len ) {
+			return -EINVAL;
+		}
+		pos += 2 + ( hdr[pos] | (hdr[pos + 1] << 8) );
+	}
+	if ( (flg & 0x08) ) {                /* FNAME    */
+		while ( pos < len && hdr[pos++] )
+			;
+	}
+	if ( (flg & 0x10) ) {                /* FCOMMENT */
+		while ( pos < len && hdr[pos++] )
+			;
+	}
+	if ( (flg & 0x02) ) {                /* FHCRC    */
+		pos += 2;
+	}
+	if ( pos >= len ) {
+		return -EINVAL;
+	}
+
+	if ( ! (gz = kzalloc( sizeof(*gz), GFP_KERNEL )) ) {
+		return -ENOMEM;
+	}
+	strm = &gz->strm;
+	if ( ! (strm->workspace = vmalloc( zlib_inflate_workspacesize() )) ) {
+		kfree( gz );
+		return -ENOMEM;
+	}
+	if ( Z_OK != zlib_inflateInit2( strm, -MAX_WBITS ) ) {
+		vfree( strm->workspace );
+		kfree( gz );
+		return -EINVAL;
+	}
+	gz->crc   = ~0U;
+
+	dec->priv = gz;
+	*used     = pos;
+
+	return 0;
+}
+
+static int
+gz_run(struct fpga_prog_dec *dec, const u8 *in, size_t *in_pos, size_t in_len, u8 *out, size_t *out_pos, size_t out_len)
+{
+struct fpga_prog_gz *gz    = dec->priv;
+z_stream            *strm  = &gz->strm;
+size_t               start = *out_pos;
+size_t               n;
+int                  rc;
+
+	if ( ! gz->end ) {
+		strm->next_in   = in  + *in_pos;
+		strm->avail_in  = in_len  - *in_pos;
+		strm->next_out  = out + *out_pos;
+		strm->avail_out = out_len - *out_pos;
+
+		rc = zlib_inflate( strm, Z_SYNC_FLUSH );
+
+		*in_pos  = in_len  - strm->avail_in;
+		*out_pos = out_len - strm->avail_out;
+
+		gz->crc    = crc32_le( gz->crc, out + start, *out_pos - start );
+		gz->isize += *out_pos - start;
+
+		switch ( rc ) {
+			case Z_STREAM_END: gz->end = 1; break;
+			case Z_OK:
+			case Z_BUF_ERROR:  return 0;
+			default:           return -EINVAL;
+		}
+	}
+
+	n = min_t( size_t, sizeof(gz->trl) - gz->ntrl, in_len - *in_pos );
+	memcpy( gz->trl + gz->ntrl, in + *in_pos, n );
+	gz->ntrl += n;
+	*in_pos  += n;
+
+	if ( gz->ntrl < sizeof(gz->trl) ) {
+		return 0;
+	}
+
+	if ( get_unaligned_le32( gz->trl ) != ~gz->crc || get_unaligned_le32( gz->trl + 4 ) != gz->isize ) {
+		printk(KERN_ERR "%s: gzip CRC or length mismatch\n", drvnam);
+		return -EINVAL;
+	}
+
+	return 1;
+}
+
+static void
+gz_fini(struct fpga_prog_dec *dec)
+{
+struct fpga_prog_gz *gz = dec->priv;
+
+	zlib_inflateEnd( &gz->strm );
+	vfree( gz->strm.workspace );
+	kfree( gz );
+}
+#endif
+
+#if IS_ENABLED(CONFIG_XZ_DEC)
+static const u8 xz_magic[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+
+static int
+xz_init(struct fpga_prog_dec *dec, const u8 *hdr, size_t len, size_t *used)
+{
+	/* allow for dictionaries up to 64MB */
+	if ( ! (dec->priv = xz_dec_init( XZ_DYNALLOC, 1U << 26 )) ) {
+		return -ENOMEM;
+	}
+	*used = 0;
+	return 0;
+}
+
+static int
+xz_run(struct fpga_prog_dec *dec, const u8 *in, size_t *in_pos, size_t in_len, u8 *out, size_t *out_pos, size_t out_len)
+{
+struct xz_buf b;
+enum xz_ret   rc;
+
+	b.in       = in;
+	b.in_pos   = *in_pos;
+	b.in_size  = in_len;
+	b.out      = out;
+	b.out_pos  = *out_pos;
+	b.out_size = out_len;
+
+	rc = xz_dec_run( dec->priv, &b );
+
+	*in_pos  = b.in_pos;
+	*out_pos = b.out_pos;
+
+	switch ( rc ) {
+		case XZ_STREAM_END:        return 1;
+		case XZ_OK:
+		case XZ_UNSUPPORTED_CHECK: return 0;
+		case XZ_MEM_ERROR:
+		case XZ_MEMLIMIT_ERROR:    return -ENOMEM;
+		default:                   break;
+	}
+	return -EINVAL;
+}
+
+static void
+xz_fini(struct fpga_prog_dec *dec)
+{
+	xz_dec_end( dec->priv );
+}
+#endif
+
+#if IS_ENABLED(CONFIG_ZSTD_DECOMPRESS)
+static const u8 zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+/* the zstd API was renamed in 5.16 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+typedef zstd_in_buffer   zst_in_t;
+typedef zstd_out_buffer  zst_out_t;
+#else
+typedef ZSTD_inBuffer    zst_in_t;
+typedef ZSTD_outBuffer   zst_out_t;
+#endif
+
+static int
+zst_init(struct fpga_prog_dec *dec, const u8 *hdr, size_t len, size_t *used)
+{
+size_t wsize, wksp_size;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+zstd_frame_header fh;
+
+	if ( zstd_get_frame_header( &fh, hdr, len ) ) {
+		return -EINVAL;
+	}
+	wsize = fh.windowSize;
+#else
+ZSTD_frameParams  fh;
+
+	if ( ZSTD_getFrameParams( &fh, hdr, len ) ) {
+		return -EINVAL;
+	}
+	wsize = fh.windowSize;
+#endif
+
+	/* refuse absurd window sizes */
+	if ( wsize > (1U << 27) ) {
+		return -EINVAL;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+	wksp_size = zstd_dstream_workspace_bound( wsize );
+#else
+	wksp_size = ZSTD_DStreamWorkspaceBound( wsize );
+#endif
+
+	if ( ! (dec->wksp = vmalloc( wksp_size )) ) {
+		return -ENOMEM;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+	dec->priv = zstd_init_dstream( wsize, dec->wksp, wksp_size );
+#else
+	dec->priv = ZSTD_initDStream( wsize, dec->wksp, wksp_size );
+#endif
+	if ( ! dec->priv ) {
+		vfree( dec->wksp );
+		return -EINVAL;
+	}
+
+	*used = 0;
+	return 0;
+}
+
+static int
+zst_run(struct fpga_prog_dec *dec, const u8 *in, size_t *in_pos, size_t in_len, u8 *out, size_t *out_pos, size_t out_len)
+{
+zst_in_t  ib = { .src = in,  .size = in_len,  .pos = *in_pos  };
+zst_out_t ob = { .dst = out, .size = out_len, .pos = *out_pos };
+size_t    rc;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+	rc = zstd_decompress_stream( dec->priv, &ob, &ib );
+	if ( zstd_is_error( rc ) ) {
+		return -EINVAL;
+	}
+#else
+	rc = ZSTD_decompressStream( dec->priv, &ob, &ib );
+	if ( ZSTD_isError( rc ) ) {
+		return -EINVAL;
+	}
+#endif
+
+	*in_pos  = ib.pos;
+	*out_pos = ob.pos;
+
+	/* 0 means the frame is complete */
+	return 0 == rc ? 1 : 0;
+}
+
+static void
+zst_fini(struct fpga_prog_dec *dec)
+{
+	vfree( dec->wksp );
+}
+#endif
+
+static const struct fpga_prog_dec_ops decompressors[] = {
+#if IS_ENABLED(CONFIG_ZLIB_INFLATE)
+	{ "gzip", gz_magic,   sizeof(gz_magic),   gz_init,  gz_run,  gz_fini  },
+#endif
+#if IS_ENABLED(CONFIG_XZ_DEC)
+	{ "xz",   xz_magic,   sizeof(xz_magic),   xz_init,  xz_run,  xz_fini  },
+#endif
+#if IS_ENABLED(CONFIG_ZSTD_DECOMPRESS)
+	{ "zstd", zstd_magic, sizeof(zstd_magic), zst_init, zst_run, zst_fini },
+#endif
+	{ 0 }
+};
+
+/* Longest magic number we have to look at */
+#define FPGA_PROG_MAGIC_MAX 6
+
+/* Input made available to 'init' for a stream following another one
+ * (the first one sees an entire input window)
+ */
+#define FPGA_PROG_DEC_HDR_MAX 4096
+
+static const struct fpga_prog_dec_ops *
+dec_lookup(const u8 *hdr, size_t len)
+{
+const struct fpga_prog_dec_ops *ops;
+
+	for ( ops = decompressors; ops->name; ops++ ) {
+		if ( len >= ops->magic_len && ! memcmp( hdr, ops->magic, ops->magic_len ) ) {
+			return ops;
+		}
+	}
+	return 0;
+}
+
+/* Decompress the input into a page-backed image. The input may consist
+ * of several concatenated streams (gzip members, zstd frames, xz streams)
+ * of the same format; anything else following a stream is an error.
+ */
+static int
+img_decompress(struct fpga_prog_img *img, const struct fpga_prog_dec_ops *ops, struct fpga_prog_in *in)
+{
+struct fpga_prog_dec dec = { 0 };
+size_t               in_pos, out_pos, off, used;
+struct page         *pg;
+u8                  *va;
+int                  st;
+
+	if ( (st = in_fill( in )) ) {
+		return st;
+	}
+
+	if ( (st = ops->init( &dec, in->ptr, in->len, &in->used )) ) {
+		return st;
+	}
+
+	do {
+		if ( 1 == st ) {
+			/* end of a stream; done unless another one follows */
+			ops->fini( &dec );
+			if ( (st = in_need( in, FPGA_PROG_DEC_HDR_MAX )) ) {
+				return st;
+			}
+			if ( in->used == in->len ) {
+				return 0;
+			}
+			if ( dec_lookup( in->ptr + in->used, in->len - in->used ) != ops ) {
+				printk(KERN_ERR "%s: %s image is followed by trailing data\n", drvnam, ops->name);
+				return -EINVAL;
+			}
+			memset( &dec, 0, sizeof(dec) );
+			if ( (st = ops->init( &dec, in->ptr + in->used, in->len - in->used, &used )) ) {
+				return st;
+			}
+			in->used += used;
+		}
+
+		if ( (st = in_fill( in )) ) {
+			break;
+		}
+
+		/* always provide room for output */
+		if ( (st = img_grow( img, img->size + 1 )) ) {
+			break;
+		}
+
+		in_pos  = in->used;
+		off     = offset_in_page( img->size );
+		out_pos = off;
+		pg      = img->pages[ img->size >> PAGE_SHIFT ];
+		va      = kmap( pg );
+
+		st = ops->run( &dec, in->ptr, &in->used, in->len, va, &out_pos, PAGE_SIZE );
+
+		img_hash_update( img, va + off, out_pos - off );
+
+		kunmap( pg );
+
+		img->size += out_pos - off;
+
+		if ( 0 == st && in_pos == in->used && off == out_pos ) {
+			/* No progress; this is only OK if the decompressor needs
+			 * more input and there is more.
+			 */
+			if ( in->used < in->len || in->pos >= in->size ) {
+				printk(KERN_ERR "%s: %s image is truncated or corrupt\n", drvnam, ops->name);
+				st = -EINVAL;
+			}
+		}
+
+		cond_resched();
+	} while ( st >= 0 );
+
+	ops->fini( &dec );
+
+	return st;
+}
+
+/* Decompress an image held in memory
+ *
+ * RETURNS: 1 if the data were compressed (and have been decompressed into 'img'),
+ *          0 if the data are not compressed, negative status on error.
+ */
+static int
+img_decompress_buf(struct fpga_prog_img *img, const void *buf, size_t size)
+{
+const struct fpga_prog_dec_ops *ops;
+struct fpga_prog_in             in = { 0 };
+int                             st;
+
+	if ( ! (ops = dec_lookup( buf, size )) ) {
+		return 0;
+	}
+
+	in.buf  = buf;
+	in.size = size;
+
+	img_hash_start( img );
+
+	if ( (st = img_decompress( img, ops, &in )) ) {
+		img_hash_abort( img );
+		return st;
+	}
+
+	img_hash_final( img );
+
+	return 1;
+}
+
+/* Read an image from a file, decompressing it on the fly if necessary
+ */
+static int
+img_read_image(struct fpga_prog_img *img, struct file *f, loff_t size)
+{
+const struct fpga_prog_dec_ops *ops;
+struct fpga_prog_in             in   = { 0 };
+u8                              hdr[FPGA_PROG_MAGIC_MAX];
+loff_t                          pos  = 0;
+ssize_t                         got;
+int                             st;
+
+	got = file_read( f, hdr, min_t( loff_t, sizeof(hdr), size ), &pos );
+	if ( got < 0 ) {
+		return got;
+	}
+
+	img_hash_start( img );
+
+	if ( ! (ops = dec_lookup( hdr, got )) ) {
+		st = img_read_file( img, f, size );
+	} else if ( ! (in.chunk = kmalloc( FPGA_PROG_IN_CHUNK, GFP_KERNEL )) ) {
+		st = -ENOMEM;
+	} else {
+		in.f    = f;
+		in.size = size;
+
+		st = img_decompress( img, ops, &in );
+
+		kfree( in.chunk );
+	}
+
+	if ( st ) {
+		img_hash_abort( img );
+	} else {
+		img_hash_final( img );
+	}
+
+	return st;
+}
+
+/* Xilinx .bit files
+ *
+ * The header consists of a fixed preamble followed by fields identified
+ * by a key character: 'a' (design), 'b' (part), 'c' (date) and 'd' (time)
+ * with 16-bit length and 'e' with the 32-bit length of the payload.
+ * All numbers are big-endian.
+ */
+#define FPGA_PROG_BIT_HDR_MAX 512
+
+static const u8 bit_magic[] = { 0x00, 0x09, 0x0f, 0xf0, 0x0f, 0xf0, 0x0f, 0xf0, 0x0f, 0xf0, 0x00, 0x00, 0x01 };
+
+/* Parse a .bit header
+ *
+ * RETURNS: offset of the payload (its length in *plen) and the part name,
+ *          0 if this is not a .bit file, negative status on error.
+ */
+static int
+bit_parse(const u8 *hdr, size_t len, char *part, size_t *plen)
+{
+size_t pos = sizeof(bit_magic);
+size_t flen, n;
+u8     key;
+
+	if ( len < pos || memcmp( hdr, bit_magic, pos ) ) {
+		return 0;
+	}
+
+	part[0] = 0;
+
+	while ( pos < len ) {
+		key = hdr[pos++];
+		if ( 'e' == key ) {
+			if ( pos + 4 > len ) {
+				break;
+			}
+			*plen = get_unaligned_be32( hdr + pos );
+			return pos + 4;
+		}
+		if ( pos + 2 > len ) {
+			break;
+		}
+		flen = get_unaligned_be16( hdr + pos );
+		pos += 2;
+		if ( pos + flen > len ) {
+			break;
+		}
+		if ( 'b' == key ) {
+			/* string is NUL-terminated (unless it is corrupt) */
+			n = min_t( size_t, strnlen( (const char*)hdr + pos, flen ), FPGA_PROG_PART_MAX - 1 );
+			memcpy( part, hdr + pos, n );
+			part[n] = 0;
+		}
+		pos += flen;
+	}
+
+	printk(KERN_ERR "%s: corrupt .bit header\n", drvnam);
+	return -EINVAL;
+}
+
+/* Copy data out of a source
+ */
+static void
+src_copy(struct fpga_prog_src *src, size_t pos, void *dst, size_t len)
+{
+struct fpga_prog_img *img = src->img;
+size_t                off, chunk;
+void                 *va;
+
+	if ( ! img ) {
+		memcpy( dst, src->buf + pos, len );
+		return;
+	}
+
+	while ( len > 0 ) {
+		off   = offset_in_page( img->off + pos );
+		chunk = min_t( size_t, len, PAGE_SIZE - off );
+		va    = kmap( img->pages[ (img->off + pos) >> PAGE_SHIFT ] );
+		memcpy( dst, va + off, chunk );
+		kunmap( img->pages[ (img->off + pos) >> PAGE_SHIFT ] );
+		dst  += chunk;
+		pos  += chunk;
+		len  -= chunk;
+	}
+}
+
+/* Convert a .bit file: strip the header and (optionally) byte-swap the
+ * payload (32-bit words). 'src' refers to either 'img' (which is owned by
+ * the caller) or to a buffer. The converted image is left in 'src' (and
+ * 'img' if it had to be copied). Other images are left alone.
+ *
+ * RETURNS: 1 if the image was converted, 0 if it is no .bit file or
+ *          a negative error status.
+ */
+static int
+bit_convert(struct fpga_prog_src *src, struct fpga_prog_img *img, int swap, char *part)
+{
+u8                   hdr[FPGA_PROG_BIT_HDR_MAX];
+struct fpga_prog_img cvt = { 0 };
+size_t               size = src->img ? src->img->size : src->count;
+size_t               hlen, plen, pos, chunk;
+u32                 *w;
+void                *va;
+int                  st;
+
+	part[0] = 0;
+
+	src_copy( src, 0, hdr, min( size, sizeof(hdr) ) );
+
+	if ( (st = bit_parse( hdr, min( size, sizeof(hdr) ), part, &plen )) <= 0 ) {
+		return st;
+	}
+	hlen = st;
+
+	if ( plen > size - hlen ) {
+		printk(KERN_ERR "%s: truncated .bit file\n", drvnam);
+		return -EINVAL;
+	}
+
+	if ( ! swap ) {
+		/* just skip the header; the digest must cover the payload only
+		 * (this costs another pass over the image in memory)
+		 */
+		if ( src->img ) {
+			img->off  += hlen;
+			img->size  = plen;
+			img->digest_valid = ( 0 == src_digest( src, img->digest ) );
+		} else {
+			src->buf   += hlen;
+			src->count  = plen;
+		}
+		return 1;
+	}
+
+	if ( (plen & 3) ) {
+		return -EINVAL;
+	}
+
+	/* copy into a page-aligned image so that no word straddles pages */
+	if ( (st = img_grow( &cvt, plen )) ) {
+		img_free( &cvt );
+		return st;
+	}
+
+	img_hash_start( &cvt );
+
+	for ( pos = 0; pos < plen; pos += chunk ) {
+		chunk = min_t( size_t, plen - pos, PAGE_SIZE );
+		va    = kmap( cvt.pages[ pos >> PAGE_SHIFT ] );
+		src_copy( src, hlen + pos, va, chunk );
+		for ( w = va; (void*)w < va + chunk; w++ ) {
+			swab32s( w );
+		}
+		img_hash_update( &cvt, va, chunk );
+		kunmap( cvt.pages[ pos >> PAGE_SHIFT ] );
+		cond_resched();
+	}
+	cvt.size = plen;
+
+	img_hash_final( &cvt );
+
+	img_free( img );
+	*img       = cvt;
+	src->img   = img;
+	src->buf   = 0;
+	src->count = 0;
+
+	return 1;
+}
+
+/* Image cache
+ *
+ * 'cache_mutex' protects the LRU list (most recently used entry
+ * first) and the counters.
+ */
+static DEFINE_MUTEX( cache_mutex );
+static LIST_HEAD( cache_lru );
+static unsigned long cache_bytes;
+static unsigned int  cache_entries;
+static unsigned long cache_hits;
+static unsigned long cache_misses;
+
+static void
+cache_release(struct kref *ref)
+{
+struct fpga_prog_cent *cent = container_of( ref, struct fpga_prog_cent, ref );
+
+	img_free( &cent->img );
+	kfree( cent->path );
+	kfree( cent );
+}
+
+static void
+cache_put(struct fpga_prog_cent *cent)
+{
+	kref_put( &cent->ref, cache_release );
+}
+
+/* Remove an entry from the LRU list (called with cache_mutex held);
+ * the memory is released once the last user is done.
+ */
+static void
+cache_evict(struct fpga_prog_cent *cent)
+{
+	list_del( &cent->lru );
+	cache_bytes -= (unsigned long)cent->img.npages << PAGE_SHIFT;
+	cache_entries--;
+	cache_put( cent );
+}
+
+/* Evict least recently used entries until no more than 'limit' bytes
+ * are used; returns the number of pages released (cache_mutex held).
+ */
+static unsigned long
+cache_trim(unsigned long limit, unsigned long max_pages)
+{
+struct fpga_prog_cent *cent;
+unsigned long          freed = 0;
+
+	while ( cache_bytes > limit && freed < max_pages && ! list_empty( &cache_lru ) ) {
+		cent   = list_last_entry( &cache_lru, struct fpga_prog_cent, lru );
+		freed += cent->img.npages;
+		cache_evict( cent );
+	}
+
+	return freed;
+}
+
+static int
+cache_match(struct fpga_prog_cent *cent, struct kstat *st)
+{
+	return    cent->dev        == st->dev
+	       && cent->ino        == st->ino
+	       && cent->mtime_sec  == st->mtime.tv_sec
+	       && cent->mtime_nsec == st->mtime.tv_nsec
+	       && cent->fsize      == st->size;
+}
+
+/* Read an open file into a new (converted) entry which is not on the LRU list
+ *
+ * RETURNS: entry (reference must be dropped with cache_put()) or error
+ *          status encoded in the pointer
+ */
+static struct fpga_prog_cent *
+cent_read(const char *path, struct file *f, struct kstat *st, int swap)
+{
+struct fpga_prog_cent *cent;
+struct fpga_prog_src   src = { 0 };
+int                    err;
+
+	if ( ! (cent = kzalloc( sizeof(*cent), GFP_KERNEL )) ) {
+		return ERR_PTR( -ENOMEM );
+	}
+
+	kref_init( &cent->ref );
+	cent->dev        = st->dev;
+	cent->ino        = st->ino;
+	cent->mtime_sec  = st->mtime.tv_sec;
+	cent->mtime_nsec = st->mtime.tv_nsec;
+	cent->fsize      = st->size;
+	cent->swap       = swap;
+
+	if ( ! (cent->path = kstrdup( path, GFP_KERNEL )) ) {
+		err = -ENOMEM;
+	} else if ( ! (err = img_read_image( &cent->img, f, st->size )) ) {
+		/* keep the converted image */
+		src.img = &cent->img;
+		if ( (err = bit_convert( &src, &cent->img, swap, cent->part )) > 0 ) {
+			cent->bit = 1;
+			err       = 0;
+		}
+	}
+
+	if ( err ) {
+		cache_put( cent );
+		return ERR_PTR( err );
+	}
+
+	return cent;
+}
+
+/* Look up a file in the cache and read it if it is not present (or stale).
+ *
+ * RETURNS: - cache entry (reference must be dropped with cache_put())
+ *          - NULL if the file is too big to be cached
+ *          - error status encoded in the pointer
+ */
+static struct fpga_prog_cent *
+cache_get(const char *path, int swap)
+{
+struct fpga_prog_cent *cent;
+struct fpga_prog_cent *tmp;
+struct file           *f;
+struct kstat           st;
+int                    err;
+
+	f = filp_open( path, O_RDONLY, 0 );
+	if ( IS_ERR( f ) ) {
+		return ERR_CAST( f );
+	}
+
+	if ( (err = vfs_getattr( &f->f_path, &st, STATX_BASIC_STATS, AT_STATX_SYNC_AS_STAT )) ) {
+		cent = ERR_PTR( err );
+		goto bail;
+	}
+
+	if ( st.size > cache_max_bytes ) {
+		cent = 0;
+		goto bail;
+	}
+
+	mutex_lock( &cache_mutex );
+
+	list_for_each_entry( cent, &cache_lru, lru ) {
+		if ( strcmp( cent->path, path ) || cent->swap != swap ) {
+			continue;
+		}
+		if ( cache_match( cent, &st ) ) {
+			list_move( &cent->lru, &cache_lru );
+			kref_get( &cent->ref );
+			cache_hits++;
+			mutex_unlock( &cache_mutex );
+			goto bail;
+		}
+		/* stale */
+		cache_evict( cent );
+		break;
+	}
+
+	cache_misses++;
+
+	mutex_unlock( &cache_mutex );
+
+	/* Read without holding the mutex (we allocate memory and the
+	 * shrinker needs the mutex).
+	 */
+	cent = cent_read( path, f, &st, swap );
+	if ( IS_ERR( cent ) ) {
+		goto bail;
+	}
+
+	mutex_lock( &cache_mutex );
+
+	/* somebody might have read the same file meanwhile */
+	list_for_each_entry( tmp, &cache_lru, lru ) {
+		if ( ! strcmp( tmp->path, path ) && tmp->swap == swap ) {
+			cache_evict( tmp );
+			break;
+		}
+	}
+
+	/* the cache's reference */
+	kref_get( &cent->ref );
+	list_add( &cent->lru, &cache_lru );
+	cache_bytes += (unsigned long)cent->img.npages << PAGE_SHIFT;
+	cache_entries++;
+
+	cache_trim( cache_max_bytes, ULONG_MAX );
+
+	mutex_unlock( &cache_mutex );
+
+bail:
+	filp_close( f, 0 );
+	return cent;
+}
+
+/* Look up a file in the last .bit image kept by a programmer; read it if
+ * it is a different (or modified) file. A .bit image read that way replaces
+ * the kept one (other images are not kept).
+ *
+ * RETURNS: - entry (reference must be dropped with cache_put())
+ *          - error status encoded in the pointer
+ */
+static struct fpga_prog_cent *
+keep_get(struct fpga_prog_drvdat *prg, const char *path)
+{
+struct fpga_prog_cent *cent;
+struct fpga_prog_cent *old;
+struct file           *f;
+struct kstat           st;
+int                    swap = prg->bit_swap;
+int                    err;
+
+	f = filp_open( path, O_RDONLY, 0 );
+	if ( IS_ERR( f ) ) {
+		return ERR_CAST( f );
+	}
+
+	if ( (err = vfs_getattr( &f->f_path, &st, STATX_BASIC_STATS, AT_STATX_SYNC_AS_STAT )) ) {
+		cent = ERR_PTR( err );
+		goto bail;
+	}
+
+	spin_lock( &prg->lock );
+	cent = prg->kept;
+	if ( cent && ! strcmp( cent->path, path ) && cent->swap == swap && cache_match( cent, &st ) ) {
+		kref_get( &cent->ref );
+	} else {
+		cent = 0;
+	}
+	spin_unlock( &prg->lock );
+
+	if ( cent ) {
+		goto bail;
+	}
+
+	cent = cent_read( path, f, &st, swap );
+	if ( IS_ERR( cent ) || ! cent->bit ) {
+		goto bail;
+	}
+
+	/* the programmer's reference */
+	kref_get( &cent->ref );
+	spin_lock( &prg->lock );
+	old       = prg->kept;
+	prg->kept = cent;
+	spin_unlock( &prg->lock );
+
+	if ( old ) {
+		cache_put( old );
+	}
+
+bail:
+	filp_close( f, 0 );
+	return cent;
+}
+
+/* Release the .bit image kept by a programmer (if any)
+ */
+static void
+keep_drop(struct fpga_prog_drvdat *prg)
+{
+struct fpga_prog_cent *old;
+
+	spin_lock( &prg->lock );
+	old       = prg->kept;
+	prg->kept = 0;
+	spin_unlock( &prg->lock );
+
+	if ( old ) {
+		cache_put( old );
+	}
+}
+
+static unsigned long
+cache_shrink_count(struct shrinker *shrink, struct shrink_control *sc)
+{
+	return cache_bytes >> PAGE_SHIFT;
+}
+
+static unsigned long
+cache_shrink_scan(struct shrinker *shrink, struct shrink_control *sc)
+{
+unsigned long freed;
+
+	/* We might be called from an allocation made while
+	 * holding the mutex.
+	 */
+	if ( ! mutex_trylock( &cache_mutex ) ) {
+		return SHRINK_STOP;
+	}
+
+	freed = cache_trim( 0, sc->nr_to_scan );
+
+	mutex_unlock( &cache_mutex );
+
+	return freed;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+static struct shrinker *cache_shrinker;
+#else
+static struct shrinker  cache_shrinker_s = {
+	.count_objects = cache_shrink_count,
+	.scan_objects  = cache_shrink_scan,
+	.seeks         = DEFAULT_SEEKS,
+};
+#endif
+
+static int
+cache_init(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+	if ( ! (cache_shrinker = shrinker_alloc( 0, "fpga_prog-cache" )) ) {
+		return -ENOMEM;
+	}
+	cache_shrinker->count_objects = cache_shrink_count;
+	cache_shrinker->scan_objects  = cache_shrink_scan;
+	shrinker_register( cache_shrinker );
+	return 0;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+	return register_shrinker( &cache_shrinker_s, "fpga_prog-cache" );
+#else
+	return register_shrinker( &cache_shrinker_s );
+#endif
+}
+
+static void
+cache_exit(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+	shrinker_free( cache_shrinker );
+#else
+	unregister_shrinker( &cache_shrinker_s );
+#endif
+	mutex_lock( &cache_mutex );
+	cache_trim( 0, ULONG_MAX );
+	mutex_unlock( &cache_mutex );
+}
+
+/* dma-buf vmap; the API has changed a few times...
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,18,0)
+typedef struct iosys_map   dmabuf_map_t;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,11,0)
+typedef struct dma_buf_map dmabuf_map_t;
+#else
+typedef void *             dmabuf_map_t;
+#endif
+
+static void
+dmabuf_vunmap(struct dma_buf *dmabuf, dmabuf_map_t *map)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,2,0)
+	dma_buf_vunmap_unlocked( dmabuf, map );
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,11,0)
+	dma_buf_vunmap( dmabuf, map );
+#else
+	dma_buf_vunmap( dmabuf, *map );
+#endif
+}
+
+static void *
+dmabuf_vmap(struct dma_buf *dmabuf, dmabuf_map_t *map)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,11,0)
+int err;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,2,0)
+	err = dma_buf_vmap_unlocked( dmabuf, map );
+#else
+	err = dma_buf_vmap( dmabuf, map );
+#endif
+	if ( err ) {
+		return ERR_PTR( err );
+	}
+	if ( map->is_iomem ) {
+		/* the manager needs a kernel virtual address */
+		dmabuf_vunmap( dmabuf, map );
+		return ERR_PTR( -EOPNOTSUPP );
+	}
+	return map->vaddr;
+#else
+	*map = dma_buf_vmap( dmabuf );
+	return *map ? *map : ERR_PTR( -ENOMEM );
+#endif
+}
+
+/* Program from a dma-buf; the buffer is vmap()ed and handed to
+ * the manager (which builds a sg_table from the vmalloc area
+ * if it supports scatter-gather). I/O memory is not supported
+ * (see dmabuf_vmap()): the manager API wants a page-backed,
+ * unmapped sg_table which dma_buf_map_attachment() does not
+ * provide for such buffers.
+ */
+static int
+load_dmabuf(struct fpga_prog_drvdat *prg, struct dma_buf *dmabuf, struct fpga_prog_load_fd *lfd)
+{
+struct fpga_prog_src src = { 0 };
+dmabuf_map_t         map;
+void                *vaddr;
+int                  err;
+
+	if ( lfd->offset >= dmabuf->size ) {
+		return -EINVAL;
+	}
+	if ( ! lfd->length ) {
+		lfd->length = dmabuf->size - lfd->offset;
+	}
+	if ( lfd->length > dmabuf->size - lfd->offset ) {
+		return -EINVAL;
+	}
+
+	if ( (err = dma_buf_begin_cpu_access( dmabuf, DMA_FROM_DEVICE )) ) {
+		return err;
+	}
+
+	vaddr = dmabuf_vmap( dmabuf, &map );
+
+	if ( IS_ERR( vaddr ) ) {
+		err = PTR_ERR( vaddr );
+	} else {
+		src.buf   = vaddr + lfd->offset;
+		src.count = lfd->length;
+
+		err = request_load( prg, 0, &src, 0, 1 );
+
+		dmabuf_vunmap( dmabuf, &map );
+	}
+
+	dma_buf_end_cpu_access( dmabuf, DMA_FROM_DEVICE );
+
+	return err;
+}
+
+/* Program from a memfd; the shmem pages are referenced
+ * and mapped into a sg_table directly.
+ */
+static int
+load_memfd(struct fpga_prog_drvdat *prg, struct file *file, struct fpga_prog_load_fd *lfd)
+{
+struct fpga_prog_img img   = { 0 };
+struct fpga_prog_src src   = { 0 };
+unsigned int         seals = F_SEAL_WRITE | F_SEAL_SHRINK;
+loff_t               fsz   = i_size_read( file_inode( file ) );
+pgoff_t              idx;
+struct page         *pg;
+int                  err;
+
+	if ( ! shmem_mapping( file->f_mapping ) ) {
+		return -EBADF;
+	}
+
+	/* the image must not change while we program it */
+	if ( (SHMEM_I( file_inode( file ) )->seals & seals) != seals ) {
+		return -EPERM;
+	}
+
+	if ( lfd->offset >= fsz ) {
+		return -EINVAL;
+	}
+	if ( ! lfd->length ) {
+		lfd->length = fsz - lfd->offset;
+	}
+	if ( lfd->length > fsz - lfd->offset ) {
+		return -EINVAL;
+	}
+
+	img.off      = offset_in_page( lfd->offset );
+	img.size     = lfd->length;
+	img.maxpages = DIV_ROUND_UP( img.off + img.size, PAGE_SIZE );
+
+	if ( ! (img.pages = kvmalloc_array( img.maxpages, sizeof(*img.pages), GFP_KERNEL )) ) {
+		return -ENOMEM;
+	}
+
+	idx = lfd->offset >> PAGE_SHIFT;
+	err = 0;
+	while ( img.npages < img.maxpages ) {
+		pg = shmem_read_mapping_page( file->f_mapping, idx + img.npages );
+		if ( IS_ERR( pg ) ) {
+			err = PTR_ERR( pg );
+			break;
+		}
+		img.pages[ img.npages++ ] = pg;
+	}
+
+	if ( ! err ) {
+		src.img = &img;
+		err     = request_load( prg, 0, &src, 0, 1 );
+	}
+
+	/* drops the page references */
+	img_free( &img );
+
+	return err;
+}
+
+static int
+load_from_fd(struct fpga_prog_drvdat *prg, struct fpga_prog_load_fd *lfd)
+{
+struct dma_buf *dmabuf;
+struct file    *file;
+int             err;
+
+	dmabuf = dma_buf_get( lfd->fd );
+	if ( ! IS_ERR( dmabuf ) ) {
+		err = load_dmabuf( prg, dmabuf, lfd );
+		dma_buf_put( dmabuf );
+		return err;
+	}
+
+	/* not a dma-buf; try memfd */
+	if ( ! (file = fget( lfd->fd )) ) {
+		return -EBADF;
+	}
+
+	err = load_memfd( prg, file, lfd );
+
+	fput( file );
+
+	return err;
+}
+
+/* Pin user pages (read-only access); the API has changed a few times...
+ */
+static int
+user_pages_pin(unsigned long start, int n, struct page **pages)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+	return pin_user_pages_fast( start, n, 0, pages );
+#else
+	return get_user_pages_fast( start, n, 0, pages );
+#endif
+}
+
+static void
+user_pages_unpin(struct page **pages, unsigned long n)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+	unpin_user_pages( pages, n );
+#else
+	while ( n > 0 ) {
+		put_page( pages[--n] );
+	}
+#endif
+}
+
+/* Program from user memory; the pages are pinned and
+ * mapped into a sg_table directly.
+ */
+static int
+load_user(struct fpga_prog_drvdat *prg, struct fpga_prog_load_user *lu)
+{
+struct fpga_prog_img img   = { 0 };
+struct fpga_prog_src src   = { 0 };
+u64                  times[FPGA_PROG_N_PHASES] = { 0 };
+void __user         *uptr  = u64_to_user_ptr( lu->addr );
+unsigned long        start;
+ktime_t              t0    = ktime_get();
+int                  n, err = 0;
+
+	/* the range must be addressable (32-bit kernels) and must not wrap around */
+	if (    ! lu->length
+	     || (u64)(unsigned long)lu->addr != lu->addr
+	     || lu->length > ULONG_MAX - (unsigned long)lu->addr ) {
+		return -EINVAL;
+	}
+	if ( lu->length > max_image_size ) {
+		return -EFBIG;
+	}
+
+	start        = (unsigned long)uptr & PAGE_MASK;
+	img.off      = offset_in_page( uptr );
+	img.size     = lu->length;
+	img.maxpages = DIV_ROUND_UP( img.off + img.size, PAGE_SIZE );
+
+	if ( ! (img.pages = kvmalloc_array( img.maxpages, sizeof(*img.pages), GFP_KERNEL )) ) {
+		return -ENOMEM;
+	}
+
+	while ( img.npages < img.maxpages ) {
+		n = user_pages_pin( start + ((unsigned long)img.npages << PAGE_SHIFT), img.maxpages - img.npages, img.pages + img.npages );
+		if ( n <= 0 ) {
+			err = n ? n : -EFAULT;
+			break;
+		}
+		img.npages += n;
+	}
+
+	times[FPGA_PROG_PHASE_FETCH] = ktime_to_ns( ktime_sub( ktime_get(), t0 ) );
+
+	if ( ! err ) {
+		stats_record( prg, FPGA_PROG_PHASE_FETCH, times[FPGA_PROG_PHASE_FETCH] );
+		src.img   = &img;
+		src.times = times;
+		err       = request_load( prg, 0, &src, 0, 1 );
+	}
+
+	user_pages_unpin( img.pages, img.npages );
+	kvfree( img.pages );
+
+	lu->pin_ns     = times[FPGA_PROG_PHASE_FETCH];
+	lu->acquire_ns = times[FPGA_PROG_PHASE_ACQUIRE];
+	lu->load_ns    = times[FPGA_PROG_PHASE_LOAD];
+	lu->total_ns   = times[FPGA_PROG_PHASE_TOTAL];
+	lu->wait_ns    = times[FPGA_PROG_PHASE_WAIT];
+
+	return err;
+}
+
+/* Reserved-memory regions which have been returned to the page allocator
+ * (they must not be mapped again if a programmer is re-bound)
+ */
+struct fpga_prog_released {
+	struct list_head        list;
+	phys_addr_t             base;
+};
+
+static LIST_HEAD( mem_released );
+static DEFINE_MUTEX( mem_released_mutex );
+
+static int
+mem_region_released(phys_addr_t base)
+{
+struct fpga_prog_released *rel;
+int                        rval = 0;
+
+	mutex_lock( &mem_released_mutex );
+	list_for_each_entry( rel, &mem_released, list ) {
+		if ( rel->base == base ) {
+			rval = 1;
+			break;
+		}
+	}
+	mutex_unlock( &mem_released_mutex );
+
+	return rval;
+}
+
+/* Map the image preloaded into the reserved-memory region referenced by
+ * 'memory-region' ('pnod' is our OF node). 'image-size' optionally gives
+ * the size of the image (default: the entire region). The region must be
+ * part of the linear mapping, i.e., 'no-map' regions are not supported.
+ *
+ * RETURNS: 0 (also if there is no region) or negative errno.
+ */
+static int
+mem_region_map(struct fpga_prog_drvdat *prg, struct device_node *pnod)
+{
+struct device_node   *rnod;
+struct resource       res;
+struct fpga_prog_img *img;
+unsigned long         pfn;
+unsigned int          i;
+u32                   val;
+int                   reusable;
+int                   err;
+
+	if ( ! (rnod = of_parse_phandle( pnod, "memory-region", 0 )) ) {
+		return 0;
+	}
+
+	err      = of_address_to_resource( rnod, 0, &res );
+	reusable = of_property_read_bool( rnod, "reusable" );
+
+	if ( ! err && of_property_read_bool( rnod, "no-map" ) ) {
+		printk(KERN_ERR "%s: 'memory-region' must not be 'no-map'\n", drvnam);
+		err = -EINVAL;
+	}
+
+	of_node_put( rnod );
+
+	if ( err ) {
+		return err;
+	}
+
+	if ( mem_region_released( res.start ) ) {
+		return 0;
+	}
+
+	if ( ! (img = kzalloc( sizeof(*img), GFP_KERNEL )) ) {
+		return -ENOMEM;
+	}
+
+	img->off  = offset_in_page( res.start );
+	img->size = resource_size( &res );
+
+	if ( 0 == (err = of_property_read_u32( pnod, "image-size", &val )) ) {
+		if ( 0 == val || val > img->size ) {
+			printk(KERN_ERR "%s: invalid 'image-size' (%u; 'memory-region' has %zu bytes)\n", drvnam, val, img->size);
+			kfree( img );
+			return -EINVAL;
+		}
+		img->size = val;
+	}
+
+	img->maxpages = DIV_ROUND_UP( img->off + img->size, PAGE_SIZE );
+
+	if ( ! (img->pages = kvmalloc_array( img->maxpages, sizeof(*img->pages), GFP_KERNEL )) ) {
+		kfree( img );
+		return -ENOMEM;
+	}
+
+	/* no references are taken; the pages are reserved */
+	pfn = PHYS_PFN( res.start );
+	for ( i=0; i<img->maxpages; i++ ) {
+		if ( ! pfn_valid( pfn + i ) ) {
+			printk(KERN_ERR "%s: 'memory-region' is not backed by struct pages\n", drvnam);
+			kvfree( img->pages );
+			kfree( img );
+			return -EINVAL;
+		}
+		img->pages[i] = pfn_to_page( pfn + i );
+	}
+	img->npages = img->maxpages;
+
+	prg->mem_img     = img;
+	prg->mem_base    = res.start;
+	prg->mem_size    = resource_size( &res );
+	/* CMA regions are not ours to give away */
+	prg->mem_release = prg->mem_release && ! reusable;
+
+	return 0;
+}
+
+static void
+mem_region_unmap(struct fpga_prog_drvdat *prg)
+{
+	if ( prg->mem_img ) {
+		/* the pages are not ours; don't use img_free() */
+		kvfree( prg->mem_img->pages );
+		kfree( prg->mem_img );
+		prg->mem_img = 0;
+	}
+}
+
+/* Return the region holding the image to the page allocator. This is
+ * only possible if we are built into the kernel (free_reserved_page()
+ * relies on symbols which are not exported). The pages are freed one
+ * by one (rather than by free_reserved_area(), which needs a virtual
+ * address) since the region may be in highmem (e.g., 32-bit ARM).
+ */
+static void
+mem_region_release(struct fpga_prog_drvdat *prg)
+{
+#ifndef MODULE
+struct fpga_prog_released *rel;
+unsigned long              pfn;
+
+	if ( ! (rel = kmalloc( sizeof(*rel), GFP_KERNEL )) ) {
+		return;
+	}
+	rel->base = prg->mem_base;
+
+	mutex_lock( &mem_released_mutex );
+	list_add( &rel->list, &mem_released );
+	mutex_unlock( &mem_released_mutex );
+
+	mem_region_unmap( prg );
+
+	/* only pages entirely within the region */
+	for ( pfn = PFN_UP( prg->mem_base ); pfn < PFN_DOWN( prg->mem_base + prg->mem_size ); pfn++ ) {
+		free_reserved_page( pfn_to_page( pfn ) );
+	}
+	printk(KERN_INFO "%s: released %zu kB of 'memory-region'\n", drvnam, prg->mem_size >> 10);
+#else
+	printk(KERN_INFO "%s: 'memory-region' can only be released if the driver is built-in\n", drvnam);
+#endif
+}
+
+/* Program the image from the 'memory-region' (autoload)
+ */
+static int
+mem_region_load(struct fpga_prog_drvdat *prg, unsigned opts)
+{
+struct fpga_prog_src src = { 0 };
+int                  err;
+
+	trace_fpga_prog_autoload( &prg->pdev->dev, "memory-region" );
+
+	src.img = prg->mem_img;
+	/* 'src' requires waiting */
+	if ( 0 == (err = request_load( prg, 0, &src, opts, 1 )) && prg->mem_release ) {
+		mem_region_release( prg );
+	}
+
+	return err;
+}
+
+/* Release private data associated with our
+ * 'soft' device (fpga_prog_dev)
+ */
+static void
+release_pdev(struct device *dev)
+{
+struct fpga_prog_dev *pdev = container_of( dev, struct fpga_prog_dev, pdev.dev );
+
+	trace_fpga_prog_pdev_release( dev );
+
+	soft_index_del( pdev );
+	mref_put( &pdev->mref );
+	ida_simple_remove( &fpga_prog_ida, dev->id );
+	kfree( dev );
+
+	/* We hold on to this module for as long as any soft device exists
+	 */
+	module_put( THIS_MODULE );
+}
+
+/* Create a soft programmer device (use case 2.)
+ *
+ * On call: 'mgr'     -> fpga_manager with exclusive reference held
+ *          'mref'    -> manager's of-node (or device) with refcnt incremented
+ *
+ * RETURN:
+ *   On success (0): - the platform device was successfully added to the
+ *                     system and is managed by it now.
+ *                   - the reference count of 'THIS_MODULE' is incremented
+ *   On failure    : - negative error status is returned (-EEXIST if there
+ *                     is already a soft device for this manager)
+ *
+ *   In any case (error or success):
+ *                   - the fpga_manager is released (put)
+ *                   - the reference held by 'mref' is 'taken over'
+ *                     (ref either held by device or dropped).
+ */
+static int
+create_pdev(struct fpga_manager *mgr, struct fpga_prog_mref mref)
+{
+struct fpga_prog_dev   *prgd = 0;
+struct fpga_prog_dev   *mem  = 0;
+int                     id   = -1;
+int                     stat;
+int                     mgrPut = 0;
+
+	if ( ! ( prgd = kzalloc( sizeof(*prgd), GFP_KERNEL ) ) ) {
+		stat = -ENOMEM;
+		goto bail;
+	}
+
+	mem = prgd;
+
+	prgd->pdev.name = "prog-fpga";
+
+	id = ida_simple_get( &fpga_prog_ida, 0, 0, GFP_KERNEL );
+	if ( id < 0 ) {
+		stat = id;
+		goto bail;
+	}
+
+	prgd->pdev.id           = mgr->dev.id;
+	prgd->pdev.dev.id       = id;
+	prgd->pdev.dev.release  = release_pdev;
+
+	prgd->mref              = mref;
+
+	if ( (stat = soft_index_add( prgd )) ) {
+		goto bail;
+	}
+
+	/* must 'put' the manager before registering the device
+	 * because this may trigger the driver to be bound which
+	 * then will need the manager. Avoid deadlock by releasing
+	 * here. (The manager can only be held exclusivly.)
+	 */
+	fpga_mgr_put( mgr );
+	mgrPut = 1;
+
+	/* If the device can be successfully registered then
+	 * we must not remove this module while it is in use.
+	 */
+	__module_get( THIS_MODULE );
+
+	stat = platform_device_register( &prgd->pdev );
+	if ( stat ) {
+		module_put( THIS_MODULE );
+		goto bail;
+	}
+
+	/* After this point 'platform_device_unregister()' should take care
+	 * of the module, mref, id and memory.
+	 */
+
+	mref.node = 0;
+	mref.dev  = 0;
+	mem     =  0;
+	id      = -1;
+
+	/* Add a property that allows for the user to hot-unplug this device
+	 */
+	if ( (stat = device_create_file( &prgd->pdev.dev, &dev_attr_remove )) ) {
+		platform_device_unregister( &prgd->pdev );
+		goto bail;
+	}
+
+	trace_fpga_prog_pdev_create( &prgd->pdev.dev );
+
+bail:
+	if ( ! mgrPut ) {
+		fpga_mgr_put( mgr );
+	}
+
+	if ( id >= 0 ) {
+		ida_simple_remove( &fpga_prog_ida, id );
+	}
+
+	mref_put( &mref );
+
+	if ( mem ) {
+		soft_index_del( mem );
+		kfree( mem );
+	}
+
+	return stat;
+}
+
+
+/* Create and initialize driver-private data. The ref. held by 'mref' is
+ * either consumed by this routine (success) or must be dropped by the caller
+ * (failure).
+ */
+static struct fpga_prog_drvdat *
+create_drvdat( struct platform_device *pdev, struct fpga_prog_mref mref )
+{
+struct fpga_prog_drvdat *prog;
+struct device_node      *pnod;
+int                      stat;
+const char              *str;
+const char              *nam;
+u32                      val;
+int                      i, n;
+
+	if ( ! ( prog = kzalloc( sizeof(*prog), GFP_KERNEL ) ) ) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	prog->mref                            = mref;
+
+	if ( bound_index_add( prog ) ) {
+		kfree( prog );
+		return ERR_PTR(-EEXIST);
+	}
+
+	kref_init( &prog->ref );
+	get_device( &pdev->dev );
+
+	prog->pdev                            = pdev;
+	prog->autoload                        = FPGA_PROG_AUTOLOAD_ON;
+	prog->async                           = 0;
+	prog->state                           = FPGA_PROG_IDLE;
+	prog->err                             = 0;
+
+	INIT_WORK( &prog->work, load_work );
+	spin_lock_init( &prog->lock );
+	mutex_init( &prog->mutex );
+	mutex_init( &prog->name_mutex );
+	INIT_LIST_HEAD( &prog->parts );
+
+	prog->misc_id                         = -1;
+	atomic_set( &prog->misc_busy, 0 );
+
+	prog->info.flags                      = 0;
+	prog->info.enable_timeout_us          = 1000000;
+	prog->info.disable_timeout_us         = 1000000;
+	prog->info.config_complete_timeout_us = 1000000;
+
+	if ( (pnod = pdev->dev.of_node) ) {
+		/* try to load parameters from OF */
+		of_node_get( pnod );
+
+		stat = of_property_read_string( pnod, "file", &str );
+		if ( 0 == stat ) {
+			prog->FW_NAME = kstrdup( str, GFP_KERNEL );
+		} else if ( stat != -EINVAL ) {
+			printk(KERN_WARNING "%s: unable to read 'file' property from OF (%d)\n", drvnam, stat);
+		}
+
+		/* a keyword ("if-unconfigured") or a number */
+		if ( of_property_match_string( pnod, "autoload", "if-unconfigured" ) >= 0 ) {
+			prog->autoload = FPGA_PROG_AUTOLOAD_IF_UNCONFIGURED;
+		} else if ( 0 == (stat = of_property_read_u32( pnod, "autoload", &val )) ) {
+			prog->autoload = val ? FPGA_PROG_AUTOLOAD_ON : FPGA_PROG_AUTOLOAD_OFF;
+		} else if ( stat != -EINVAL ) {
+			printk(KERN_WARNING "%s: unable to read 'autoload' property from OF (%d)\n", drvnam, stat);
+		}
+
+		stat = of_property_read_u32( pnod, "async", &val );
+		if ( 0 == stat ) {
+			prog->async = val;
+		} else if ( stat != -EINVAL ) {
+			printk(KERN_WARNING "%s: unable to read 'async' property from OF (%d)\n", drvnam, stat);
+		}
+
+		stat = of_property_read_u32( pnod, "skip-identical", &val );
+		if ( 0 == stat ) {
+			prog->skip_identical = val;
+		} else if ( stat != -EINVAL ) {
+			printk(KERN_WARNING "%s: unable to read 'skip-identical' property from OF (%d)\n", drvnam, stat);
+		}
+
+		stat = of_property_read_string( pnod, "expected-part", &str );
+		if ( 0 == stat ) {
+			strscpy( prog->expected_part, str, sizeof(prog->expected_part) );
+		} else if ( stat != -EINVAL ) {
+			printk(KERN_WARNING "%s: unable to read 'expected-part' property from OF (%d)\n", drvnam, stat);
+		}
+
+		stat = of_property_read_u32( pnod, "bit-swap", &val );
+		if ( 0 == stat ) {
+			prog->bit_swap = val;
+		} else if ( stat != -EINVAL ) {
+			printk(KERN_WARNING "%s: unable to read 'bit-swap' property from OF (%d)\n", drvnam, stat);
+		}
+
+		stat = of_property_read_u32( pnod, "priority", &val );
+		if ( 0 == stat ) {
+			prog->priority = (int)val;
+		} else if ( stat != -EINVAL ) {
+			printk(KERN_WARNING "%s: unable to read 'priority' property from OF (%d)\n", drvnam, stat);
+		}
+
+		stat = of_property_read_string( pnod, "loader", &str );
+		if ( 0 == stat ) {
+			if ( (i = match_string( loader_names, ARRAY_SIZE( loader_names ), str )) >= 0 ) {
+				prog->loader = i;
+			} else {
+				printk(KERN_WARNING "%s: unknown 'loader' in OF ('%s')\n", drvnam, str);
+			}
+		} else if ( stat != -EINVAL ) {
+			printk(KERN_WARNING "%s: unable to read 'loader' property from OF (%d)\n", drvnam, stat);
+		}
+
+		/* devices implemented by the fabric: a 'fabric' child node
+		 * or a node referenced by 'fabric-devices'
+		 */
+		if ( ! (prog->fabric = of_parse_phandle( pnod, "fabric-devices", 0 )) ) {
+			prog->fabric = of_get_child_by_name( pnod, "fabric" );
+		}
+
+		/* image preloaded by the bootloader */
+		prog->mem_release = of_property_read_bool( pnod, "memory-region-release" );
+		if ( (stat = mem_region_map( prog, pnod )) ) {
+			printk(KERN_WARNING "%s: unable to use 'memory-region' (%d)\n", drvnam, stat);
+		}
+
+		if ( of_property_read_bool( pnod, "partial-fpga-config" ) ) {
+			prog->info.flags |= FPGA_MGR_PARTIAL_RECONFIG;
+		}
+
+		n = of_property_count_strings( pnod, "partial-image-names" );
+		if ( n > 0 && n != of_property_count_strings( pnod, "partial-images" ) ) {
+			printk(KERN_WARNING "%s: 'partial-image-names' and 'partial-images' properties don't match\n", drvnam);
+			n = 0;
+		}
+		for ( i = 0; i < n; i++ ) {
+			if (    of_property_read_string_index( pnod, "partial-image-names", i, &nam )
+			     || of_property_read_string_index( pnod, "partial-images",      i, &str )
+			     || part_set( prog, nam, str ) ) {
+				printk(KERN_WARNING "%s: unable to add partial image #%d from OF\n", drvnam, i);
+			}
+		}
+			
+		of_node_put( pnod );
+	}
+
+	return prog;
+}
+
+/* Attach to a programmer device (either soft or 'hard', i.e., from device-tree)
+ *
+ * Call: with refs. to fpga_manager and it's of-node. The 'mref' reference is
+ * 'consumed' by this routine, i.e., either stored in the driver-private data or
+ * dropped. The ref. to the manager is unchanged.
+ */
+static int
+dev_attach(struct platform_device *pdev, struct fpga_manager *mgr, struct fpga_prog_mref mref)
+{
+struct fpga_prog_drvdat *drvdat;
+struct fpga_prog_drvdat *mem  = 0;
+int                      stat = 0;
+int                      dev_attr_stat[ N_DEV_ATTRS ];
+int                      grp_stat = -1;
+int                      i;
+struct kobject          *mgrObj = 0;
+
+	for ( i=0; i<N_DEV_ATTRS; i++ ) {
+		dev_attr_stat[i] = -1;
+	}
+
+	drvdat = create_drvdat( pdev, mref );
+
+	if ( IS_ERR( drvdat ) ) {
+		mref_put( &mref );
+		stat = PTR_ERR( drvdat );
+		goto bail;
+	}
+
+	mem = drvdat;
+
+	/* for any error after here the mref is 'put' by release_drvdat */
+
+	platform_set_drvdata( pdev, drvdat );
+
+	/* Add sysfs entries to device ('file', 'autoload' etc.) */
+	for ( i=0; i<N_DEV_ATTRS; i++ ) {
+		if ( (dev_attr_stat[i] = device_create_file( &pdev->dev, dev_attrs[i] )) )
+			break;
+	}
+	if ( i < N_DEV_ATTRS ) {
+		stat = dev_attr_stat[i];
+		goto bail;
+	}
+
+	/* Add statistics */
+	if ( (stat = grp_stat = sysfs_create_group( &pdev->dev.kobj, &stats_group )) ) {
+		goto bail;
+	}
+
+	/* Add symlink to fpga_manager */
+	mgrObj = & mgr->dev.kobj;	
+
+	kobject_get( mgrObj );
+
+	stat = sysfs_create_link( &pdev->dev.kobj, mgrObj, "fpga_manager" );
+
+	kobject_put( mgrObj );
+
+	if ( stat ) {
+		goto bail;
+	}
+
+	/* Add character device */
+	if ( (stat = prog_misc_register( drvdat )) ) {
+		sysfs_remove_link( &pdev->dev.kobj, "fpga_manager" );
+		goto bail;
+	}
+
+	dev_attr_stat[0] = -1;
+	grp_stat         = -1;
+	mem              = 0;
+
+bail:
+	for ( i=0; i < N_DEV_ATTRS && dev_attr_stat[i] == 0; i++ ) {
+		device_remove_file( &pdev->dev, dev_attrs[i] );
+	}
+
+	if ( 0 == grp_stat ) {
+		sysfs_remove_group( &pdev->dev.kobj, &stats_group );
+	}
+
+	if ( mem )
+		put_drvdat( mem );
+
+	return stat;
+}
+
+/* Driver probe function
+ */
+static int
+fpga_prog_probe(struct platform_device *pdev)
+{
+struct fpga_manager     *mgr;
+struct fpga_prog_mref    mref;
+int                      stat, fwstat;
+struct fpga_prog_drvdat *prg;
+ktime_t                  t0;
+u64                      acq_ns;
+char                    *nam;
+enum fpga_mgr_states     mgr_state;
+unsigned                 opts = 0;
+
+	/* Locate an fpga_manager for this device */
+	t0  = ktime_get();
+	mgr = of_get_mgr_from_pdev( pdev, &mref );
+	if ( IS_ERR( mgr ) ) {
+		if ( -ENODEV == PTR_ERR( mgr ) && pdev->dev.of_node ) {
+			/* the manager's driver may not be bound yet; retry later */
+			return -EPROBE_DEFER;
+		}
+		printk(KERN_ERR "%s: no fpga-manager found (%ld)\n", drvnam, PTR_ERR(mgr));
+		return PTR_ERR( mgr );
+	}
+	acq_ns = ktime_to_ns( ktime_sub( ktime_get(), t0 ) );
+
+	/* dev_attach() 'consumes' the reference held by mref -
+	 * either by storing in drvdat or releasing it on failure
+	 */
+	stat = dev_attach( pdev, mgr, mref );
+
+	/* Configured by the bootloader? (see 'autoload') */
+	mgr_state = mgr->state;
+
+	/* Release manager; load_fw() acquires it again (older
+	 * kernels only hand out exclusive references).
+	 */
+	fpga_mgr_put( mgr );
+
+	if ( 0 == stat ) {
+		/* If - after successfully attaching to the device we
+		 * have enough information then we can attempt to load
+		 * firmware.
+		 */
+		prg = platform_get_drvdata( pdev );
+		stats_record( prg, FPGA_PROG_PHASE_ACQUIRE, acq_ns );
+		if (    FPGA_PROG_AUTOLOAD_IF_UNCONFIGURED == prg->autoload
+		     && boot_configured( prg, mgr_state, &opts ) ) {
+			printk(KERN_INFO "%s: FPGA already configured; skipping autoload\n", drvnam);
+			mutex_lock( &prg->mutex );
+			fabric_populate( prg );
+			mutex_unlock( &prg->mutex );
+			set_state( prg, FPGA_PROG_DONE, 0 );
+		} else if ( prg->autoload && prg->mem_img ) {
+			if ( (fwstat = mem_region_load( prg, opts )) ) {
+				printk(KERN_WARNING "%s: programming from 'memory-region' failed (%d)\n", drvnam, fwstat);
+			}
+		} else if ( prg->autoload && (nam = fw_name_dup( prg )) && ! IS_ERR( nam ) ) {
+			trace_fpga_prog_autoload( &pdev->dev, nam );
+			/* when deferred we don't wait (i.e., hold up probing);
+			 * completion is reported by 'state'.
+			 */
+			if ( (fwstat = request_load( prg, nam, 0, opts, ! (deferred_autoload || prg->async) )) ) {
+				printk(KERN_WARNING "%s: programming firmware failed (%d)\n", drvnam, fwstat);
+			}
+		}
+	}
+
+	return stat;
+}
+
+/* Cleanup driver private data (called when the last reference is dropped)
+ */
+static void
+release_drvdat(struct kref *ref)
+{
+struct fpga_prog_drvdat *prg = container_of( ref, struct fpga_prog_drvdat, ref );
+
+	/* if attaching failed */
+	bound_index_del( prg );
+
+	mref_put( &prg->mref );
+
+	of_node_put( prg->fabric );
+
+	mem_region_unmap( prg );
+
+	if ( prg->FW_NAME ) {
+		kfree( prg->FW_NAME );
+		prg->FW_NAME = 0;
+	}
+
+	while ( ! list_empty( &prg->parts ) ) {
+		part_free( list_first_entry( &prg->parts, struct fpga_prog_part, list ) );
+	}
+	kfree( prg->region );
+
+	if ( prg->staged ) {
+		fetched_release( prg->staged );
+		kfree( prg->staged );
+	}
+
+	keep_drop( prg );
+
+	put_device( &prg->pdev->dev );
+
+	kfree( prg );
+}
+
+static void
+put_drvdat(struct fpga_prog_drvdat *prg)
+{
+	kref_put( &prg->ref, release_drvdat );
+}
+
+/* Driver remove function
+ */
+static int
+fpga_prog_remove(struct platform_device *pdev)
+{
+struct fpga_prog_drvdat *prg = platform_get_drvdata( pdev );
+int                      i;
+
+	for ( i=0; i < N_DEV_ATTRS; i++ ) {
+		device_remove_file( &pdev->dev, dev_attrs[i] );
+	}
+
+	sysfs_remove_group( &pdev->dev.kobj, &stats_group );
+
+	sysfs_remove_link( &pdev->dev.kobj, "fpga_manager" );
+
+	/* The manager may be used by another programmer once we are
+	 * unbound (even if the drvdat lives on).
+	 */
+	bound_index_del( prg );
+
+	/* Refuse new jobs (the character device may still be open
+	 * and the manifest may still refer to us), cancel a pending
+	 * one and wait for the running one to finish.
+	 */
+	jobs_shutdown( prg );
+
+	/* no job is running anymore */
+	mutex_lock( &prg->mutex );
+	fabric_depopulate( prg );
+	mutex_unlock( &prg->mutex );
+
+	prog_misc_deregister( prg );
+
+	put_drvdat( prg );
+
+	return 0;
+}
+
+/* Per-entry results of 'add_programmer' ('<entry> <errno>' lines)
+ */
+struct fpga_prog_res {
+	char   *buf;
+	size_t  len;
+};
+
+static void
+res_add(struct fpga_prog_res *res, const char *name, int stat)
+{
+	if ( res ) {
+		res->len += scnprintf( res->buf + res->len, PAGE_SIZE - res->len, "%s %d\n", name, stat );
+	}
+}
+
+/* Create a soft device for the manager given by a device-tree path
+ * (or device name; see get_mgr_from_path())
+ */
+static int
+add_path(const char *path)
+{
+struct fpga_manager     *mgr;
+struct fpga_prog_mref    mref;
+
+	mgr = get_mgr_from_path( path, &mref );
+
+	if ( IS_ERR( mgr ) ) {
+		return PTR_ERR( mgr );
+	}
+	/* Hold refs to manager and mref here; create_pdev takes them
+	 * over (and fails with -EEXIST if the manager is already used
+	 * by a soft device).
+	 */
+	return create_pdev( mgr, mref );
+}
+
+/* Manager found by discover_mgrs()
+ */
+struct fpga_prog_cand {
+	struct list_head      list;
+	struct fpga_prog_mref mref;
+	char                  name[32];
+};
+
+/* Record a member of the fpga_manager class; it is referenced by its
+ * OF node (same key as if given by path) or by its parent device.
+ */
+static int
+discover_mgr(struct device *dev, void *data)
+{
+struct fpga_prog_cand *c;
+
+	if ( ! (c = kzalloc( sizeof(*c), GFP_KERNEL )) ) {
+		return -ENOMEM;
+	}
+	if ( dev->of_node ) {
+		c->mref.node = of_node_get( dev->of_node );
+	} else {
+		c->mref.dev  = get_device( dev->parent );
+	}
+	snprintf( c->name, sizeof(c->name), "%s", dev_name( dev ) );
+	list_add_tail( &c->list, data );
+
+	return 0;
+}
+
+/* Learn the fpga_manager class from any manager whose parent is
+ * a platform device (stops at the first one)
+ */
+static int
+discover_class(struct device *dev, void *data)
+{
+struct fpga_manager *mgr = mgr_seen( fpga_mgr_get( dev ) );
+
+	if ( IS_ERR( mgr ) ) {
+		return 0;
+	}
+	fpga_mgr_put( mgr );
+
+	return 1;
+}
+
+/* Create soft programmers for all registered fpga_managers which are not
+ * used by a programmer yet. Managers used by bound programmers (e.g., from
+ * the device tree) are skipped (-EEXIST); a manager which cannot be obtained
+ * is reported with its error status.
+ *
+ * RETURNS: first error (other than -EEXIST) or 0; the per-manager results
+ *          are added to 'res' (if non-NULL).
+ */
+static int
+discover_mgrs(struct fpga_prog_res *res)
+{
+LIST_HEAD( cands );
+struct fpga_prog_cand     *c, *tmp;
+struct fpga_manager       *mgr;
+int                        stat, err = 0, n = 0;
+
+	if ( ! READ_ONCE( mgr_class ) ) {
+		bus_for_each_dev( &platform_bus_type, 0, 0, discover_class );
+	}
+
+	/* we must not create devices while iterating the class */
+	if ( READ_ONCE( mgr_class ) ) {
+		err = class_for_each_device( mgr_class, 0, &cands, discover_mgr );
+	}
+
+	list_for_each_entry_safe( c, tmp, &cands, list ) {
+		list_del( &c->list );
+		if ( bound_index_has( mref_key( &c->mref ) ) ) {
+			mref_put( &c->mref );
+			stat = -EEXIST;
+		} else if ( IS_ERR( (mgr = mref_get_mgr( &c->mref )) ) ) {
+			stat = PTR_ERR( mgr );
+			mref_put( &c->mref );
+		} else {
+			stat = create_pdev( mgr, c->mref );
+		}
+
+		res_add( res, c->name, stat );
+		kfree( c );
+		if ( 0 == stat ) {
+			n++;
+		} else if ( -EEXIST != stat && ! err ) {
+			err = stat;
+		}
+	}
+
+	if ( ! res ) {
+		printk(KERN_INFO "%s: created %d programmer(s)\n", drvnam, n);
+	}
+
+	return err;
+}
+
+/* Results of the last write to 'add_programmer' (protected by the mutex)
+ */
+static DEFINE_MUTEX( add_programmer_mutex );
+static char *add_programmer_res;
+
+/* Add 'soft' devices (support 'remove' device attribute in sysfs);
+ * takes a list of device-tree paths (or device names) separated by
+ * whitespace or ';'. '*' adds all managers which are not in use.
+ */
+static ssize_t
+add_programmer_store(struct device_driver *drv, const char *buf, size_t sz)
+{
+struct fpga_prog_res     res;
+char                    *str, *s, *tok;
+int                      stat, err = 0, ntok = 0;
+
+	if ( sz > PAGE_SIZE - 1 ) {
+		return -ENOMEM;
+	}
+
+	if ( ! (str = kstrndup( buf, sz, GFP_KERNEL )) ) {
+		return -ENOMEM;
+	}
+
+	if ( ! (res.buf = kzalloc( PAGE_SIZE, GFP_KERNEL )) ) {
+		kfree( str );
+		return -ENOMEM;
+	}
+	res.len = 0;
+
+	s = str;
+	while ( (tok = strsep( &s, " \t\n;" )) ) {
+		if ( ! *tok ) {
+			continue;
+		}
+		if ( 0 == strcmp( tok, "*" ) ) {
+			stat = discover_mgrs( &res );
+		} else {
+			stat = add_path( tok );
+			res_add( &res, tok, stat );
+		}
+		ntok++;
+		/* report the first error */
+		if ( stat && ! err ) {
+			err = stat;
+		}
+	}
+
+	kfree( str );
+
+	if ( 0 == ntok ) {
+		kfree( res.buf );
+		return -EINVAL;
+	}
+
+	mutex_lock( &add_programmer_mutex );
+	kfree( add_programmer_res );
+	add_programmer_res = res.buf;
+	mutex_unlock( &add_programmer_mutex );
+
+	return err ? err : sz;
+}
+
+/* Per-entry results of the last 'add_programmer' write
+ */
+static ssize_t
+add_programmer_show(struct device_driver *drv, char *buf)
+{
+int len;
+
+	mutex_lock( &add_programmer_mutex );
+	len = snprintf( buf, PAGE_SIZE, "%s", add_programmer_res ? add_programmer_res : "" );
+	mutex_unlock( &add_programmer_mutex );
+
+	return len;
+}
+
+/* Remove a 'soft' device (support 'remove' device attribute in sysfs)
+ */
+static ssize_t
+remove_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz)
+{
+int val;
+
+	if ( kstrtoint(buf, 0, &val) ) {
+		return -EINVAL;
+	}
+
+	if ( val && device_remove_file_self( dev, att ) ) {
+		device_unregister( dev );
+	}
+
+	return sz;
+}
+
+/* Programming manifest
+ *
+ * Each entry is executed as a work item on 'fpga_prog_manifest_wq'
+ * (which bounds the number of concurrent jobs) once all the entries
+ * it depends upon have completed. Entries may only depend on entries
+ * listed earlier (no cycles possible).
+ */
+#define FPGA_PROG_MANIFEST_MAX_DEPS 8
+
+struct fpga_prog_manifest;
+
+struct fpga_prog_ment {
+	struct work_struct         work;
+	struct fpga_prog_manifest *man;
+	char                      *prog;
+	char                      *image;
+	int                        ndeps;
+	int                        deps[FPGA_PROG_MANIFEST_MAX_DEPS];
+	/* protected by the manifest's 'lock' */
+	int                        nwait;
+	int                        dep_err;
+	enum fpga_prog_state       state;
+	int                        err;
+};
+
+struct fpga_prog_manifest {
+	spinlock_t                 lock;
+	/* number of entries not completed yet */
+	int                        active;
+	int                        nent;
+	struct fpga_prog_ment      ent[];
+};
+
+/* 'manifest_mutex' protects the 'manifest' pointer
+ */
+static DEFINE_MUTEX( manifest_mutex );
+static struct fpga_prog_manifest *manifest;
+
+static void
+manifest_free(struct fpga_prog_manifest *man)
+{
+int i;
+
+	for ( i=0; i<man->nent; i++ ) {
+		kfree( man->ent[i].prog  );
+		kfree( man->ent[i].image );
+	}
+	kfree( man );
+}
+
+/* Entry 'idx' has completed; start the entries that were waiting for it
+ */
+static void
+manifest_done(struct fpga_prog_manifest *man, int idx, int err)
+{
+struct fpga_prog_ment *ent;
+int                    i, j;
+
+	spin_lock( &man->lock );
+	man->ent[idx].state = err ? FPGA_PROG_ERROR : FPGA_PROG_DONE;
+	man->ent[idx].err   = err;
+	man->active--;
+	for ( i = idx + 1; i < man->nent; i++ ) {
+		ent = &man->ent[i];
+		for ( j=0; j<ent->ndeps; j++ ) {
+			if ( ent->deps[j] != idx ) {
+				continue;
+			}
+			if ( err ) {
+				/* fails without programming */
+				ent->dep_err = -ECANCELED;
+			}
+			if ( 0 == --ent->nwait ) {
+				ent->state = FPGA_PROG_QUEUED;
+				queue_work( fpga_prog_manifest_wq, &ent->work );
+			}
+		}
+	}
+	spin_unlock( &man->lock );
+}
+
+static int
+cmp_dev_name(struct device *dev, const void *data)
+{
+	return ! strcmp( dev_name( dev ), data );
+}
+
+/* Program one manifest entry
+ */
+static void
+manifest_work(struct work_struct *work)
+{
+struct fpga_prog_ment     *ent = container_of( work, struct fpga_prog_ment, work );
+struct fpga_prog_manifest *man = ent->man;
+struct fpga_prog_drvdat   *prg = 0;
+struct device             *dev;
+char                      *nam;
+int                        err;
+
+	spin_lock( &man->lock );
+	if ( ! (err = ent->dep_err) ) {
+		ent->state = FPGA_PROG_LOADING;
+	}
+	spin_unlock( &man->lock );
+
+	if ( ! err ) {
+		if ( (dev = driver_find_device( &fpga_prog_driver.driver, 0, ent->prog, cmp_dev_name )) ) {
+			/* make sure the device is not unbound while we grab the drvdat */
+			device_lock( dev );
+			if ( dev->driver == &fpga_prog_driver.driver && (prg = get_drvdat( dev )) ) {
+				kref_get( &prg->ref );
+			}
+			device_unlock( dev );
+			put_device( dev );
+		}
+		if ( ! prg ) {
+			err = -ENODEV;
+		}
+	}
+
+	if ( prg ) {
+		if ( ! (nam = kstrdup( ent->image, GFP_KERNEL )) ) {
+			err = -ENOMEM;
+		} else {
+			fw_name_set( prg, nam );
+
+			trace_fpga_prog_request( &prg->pdev->dev, "manifest", ent->image );
+
+			if ( ! (nam = kstrdup( ent->image, GFP_KERNEL )) ) {
+				err = -ENOMEM;
+			} else {
+				err = request_load( prg, nam, 0, 0, 1 );
+			}
+		}
+		put_drvdat( prg );
+	}
+
+	if ( err ) {
+		printk(KERN_WARNING "%s: manifest: programming %s failed (%d)\n", drvnam, ent->prog, err);
+	}
+
+	manifest_done( man, ent - man->ent, err );
+}
+
+/* Next whitespace-separated token (NULL if none)
+ */
+static char *
+next_tok(char **s)
+{
+char *tok;
+
+	do {
+		if ( ! (tok = strsep( s, " \t" )) ) {
+			return 0;
+		}
+	} while ( ! *tok );
+
+	return tok;
+}
+
+/* Parse a manifest; one entry per line (or separated by ';'):
+ *
+ *   <programmer> <image> [after <programmer> ...]
+ */
+static struct fpga_prog_manifest *
+manifest_parse(char *str)
+{
+struct fpga_prog_manifest *man;
+struct fpga_prog_ment     *ent;
+char                      *line, *tok;
+int                        max, i, err = 0;
+
+	for ( max = 1, tok = str; *tok; tok++ ) {
+		if ( '\n' == *tok || ';' == *tok ) {
+			max++;
+		}
+	}
+
+	if ( ! (man = kzalloc( sizeof(*man) + max * sizeof(man->ent[0]), GFP_KERNEL )) ) {
+		return ERR_PTR( -ENOMEM );
+	}
+	spin_lock_init( &man->lock );
+
+	while ( ! err && (line = strsep( &str, "\n;" )) ) {
+		if ( ! (tok = next_tok( &line )) ) {
+			/* blank line */
+			continue;
+		}
+		ent = &man->ent[man->nent];
+		for ( i=0; i<man->nent; i++ ) {
+			if ( ! strcmp( man->ent[i].prog, tok ) ) {
+				/* programmer listed twice */
+				err = -EINVAL;
+			}
+		}
+		if ( err || ! (ent->prog = kstrdup( tok, GFP_KERNEL )) ) {
+			err = err ? err : -ENOMEM;
+			break;
+		}
+		man->nent++;
+		INIT_WORK( &ent->work, manifest_work );
+		ent->man = man;
+
+		if ( ! (tok = next_tok( &line )) ) {
+			err = -EINVAL;
+			break;
+		}
+		if ( ! (ent->image = kstrdup( tok, GFP_KERNEL )) ) {
+			err = -ENOMEM;
+			break;
+		}
+
+		if ( (tok = next_tok( &line )) ) {
+			if ( strcmp( tok, "after" ) ) {
+				err = -EINVAL;
+				break;
+			}
+			while ( (tok = next_tok( &line )) ) {
+				for ( i = man->nent - 2; i >= 0; i-- ) {
+					if ( ! strcmp( man->ent[i].prog, tok ) ) {
+						break;
+					}
+				}
+				if ( i < 0 || ent->ndeps >= FPGA_PROG_MANIFEST_MAX_DEPS ) {
+					err = -EINVAL;
+					break;
+				}
+				ent->deps[ ent->ndeps++ ] = i;
+			}
+		}
+	}
+
+	if ( ! err && 0 == man->nent ) {
+		err = -EINVAL;
+	}
+
+	if ( err ) {
+		manifest_free( man );
+		return ERR_PTR( err );
+	}
+
+	return man;
+}
+
+/* Sysfs driver attribute 'manifest' (store); program
+ * several FPGAs in parallel.
+ */
+static ssize_t
+manifest_store(struct device_driver *drv, const char *buf, size_t sz)
+{
+struct fpga_prog_manifest *man;
+struct fpga_prog_manifest *old = 0;
+char                      *str;
+int                        i;
+
+	if ( ! (str = kstrndup( buf, sz, GFP_KERNEL )) ) {
+		return -ENOMEM;
+	}
+	man = manifest_parse( str );
+	kfree( str );
+
+	if ( IS_ERR( man ) ) {
+		return PTR_ERR( man );
+	}
+
+	mutex_lock( &manifest_mutex );
+
+	if ( manifest ) {
+		spin_lock( &manifest->lock );
+		i = manifest->active;
+		spin_unlock( &manifest->lock );
+		if ( i ) {
+			mutex_unlock( &manifest_mutex );
+			manifest_free( man );
+			return -EBUSY;
+		}
+		old = manifest;
+	}
+
+	if ( old ) {
+		/* all of its jobs have completed ('active' is zero); make sure
+		 * their work items have also returned before freeing it
+		 */
+		for ( i=0; i<old->nent; i++ ) {
+			flush_work( &old->ent[i].work );
+		}
+		manifest_free( old );
+	}
+
+	/* set up all entries before starting any */
+	man->active = man->nent;
+	for ( i=0; i<man->nent; i++ ) {
+		man->ent[i].nwait = man->ent[i].ndeps;
+		man->ent[i].state = man->ent[i].ndeps ? FPGA_PROG_IDLE : FPGA_PROG_QUEUED;
+	}
+	manifest = man;
+
+	for ( i=0; i<man->nent; i++ ) {
+		if ( 0 == man->ent[i].ndeps ) {
+			queue_work( fpga_prog_manifest_wq, &man->ent[i].work );
+		}
+	}
+
+	mutex_unlock( &manifest_mutex );
+
+	return sz;
+}
+
+/* Sysfs driver attribute 'manifest' (show); report
+ * the status of each entry.
+ */
+static ssize_t
+manifest_show(struct device_driver *drv, char *buf)
+{
+struct fpga_prog_ment *ent;
+int                    i, len = 0;
+
+	mutex_lock( &manifest_mutex );
+	if ( manifest ) {
+		spin_lock( &manifest->lock );
+		for ( i=0; i<manifest->nent; i++ ) {
+			ent  = &manifest->ent[i];
+			len += snprintf( buf + len, PAGE_SIZE - len, "%s %s %s %d\n",
+			                 ent->prog, ent->image, state_names[ent->state], ent->err );
+			if ( len >= PAGE_SIZE ) {
+				len = PAGE_SIZE - 1;
+				break;
+			}
+		}
+		spin_unlock( &manifest->lock );
+	}
+	mutex_unlock( &manifest_mutex );
+
+	return len;
+}
+
+/* Helper to find driver-private data
+ */
+static struct fpga_prog_drvdat *
+get_drvdat(struct device *dev)
+{
+struct platform_device *pdev = container_of( dev, struct platform_device, dev );
+	return (struct fpga_prog_drvdat*) platform_get_drvdata( pdev );
+}
+
+/* Sysfs driver attribute 'cache_stats' (show)
+ */
+static ssize_t
+cache_stats_show(struct device_driver *drv, char *buf)
+{
+int len;
+
+	mutex_lock( &cache_mutex );
+	len = snprintf( buf, PAGE_SIZE, "hits %lu\nmisses %lu\nentries %u\nbytes %lu\n",
+	                cache_hits, cache_misses, cache_entries, cache_bytes );
+	mutex_unlock( &cache_mutex );
+
+	return len;
+}
+
+/* Driver attribute 'sched_stats' (show); wait times in microseconds
+ */
+static ssize_t
+sched_stats_show(struct device_driver *drv, char *buf)
+{
+unsigned int running, queued;
+u64          waits, sum, max;
+
+	spin_lock( &sched_lock );
+	running = sched_running;
+	queued  = sched_queued;
+	waits   = sched_waits;
+	sum     = sched_wait_ns;
+	max     = sched_wait_max_ns;
+	spin_unlock( &sched_lock );
+
+	return snprintf( buf, PAGE_SIZE, "running %u\nqueued %u\nlimit %u\nwaits %llu\nwait_mean %llu\nwait_max %llu\n",
+	                 running, queued, READ_ONCE( max_concurrent_loads ),
+	                 (unsigned long long)waits,
+	                 (unsigned long long)( waits ? div64_u64( sum, waits * 1000 ) : 0 ),
+	                 (unsigned long long)div_u64( max, 1000 ) );
+}
+
+/* Sysfs attribute 'file' (store)
+ */
+static ssize_t
+file_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz)
+{
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
+char                    *nam;
+int    err;
+
+	trace_fpga_prog_request( dev, "file", buf );
+
+	if ( ! (nam = kstrdup( buf, GFP_KERNEL )) ) {
+		return -ENOMEM;
+	}
+
+	fw_name_set( prg, nam );
+
+	if ( prg->autoload ) {
+		if ( ! (nam = kstrdup( buf, GFP_KERNEL )) ) {
+			return -ENOMEM;
+		}
+		if ( (err = request_load( prg, nam, 0, 0, ! prg->async ) ) ) {
+			sz = err;
+		}
+	}
+	return sz;
+}
+
+/* Sysfs attribute 'file' (show)
+ */
+static ssize_t
+file_show(struct device *dev, struct device_attribute *att, char *buf)
+{
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
+int                   len;
+
+	mutex_lock( &prg->name_mutex );
+	if ( ! prg->FW_NAME ) {
+		buf[0] = 0;
+		len    = 0;
+	} else {
+		len = snprintf(buf, PAGE_SIZE, "%s", prg->FW_NAME);
+		if ( len >= PAGE_SIZE )
+			len = PAGE_SIZE - 1;
+	}
+	mutex_unlock( &prg->name_mutex );
+	return len;
+}
 
-	platform_set_drvdata( pdev, drvdat );
+/* Sysfs attribute 'program' (store)
+ */
+static ssize_t
+program_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz)
+{
+struct fpga_prog_drvdat *prg  = get_drvdat( dev );
+unsigned                 opts = 0;
+char                    *nam;
+int                   val;
+int                   err;
 
-	/* Add sysfs entries to device ('file', 'autoload' etc.) */
-	for ( i=0; i<N_DEV_ATTRS; i++ ) {
-		if ( (dev_attr_stat[i] = device_create_file( &pdev->dev, dev_attrs[i] )) )
-			break;
+	if ( sysfs_streq( buf, "force" ) ) {
+		val  = 1;
+		opts = FPGA_PROG_OPT_FORCE;
+	} else if ( sysfs_streq( buf, "urgent" ) ) {
+		val  = 1;
+		opts = FPGA_PROG_OPT_FORCE | FPGA_PROG_OPT_URGENT;
+	} else if ( kstrtoint(buf, 0, &val) ) {
+		return -EINVAL;
 	}
-	if ( i < N_DEV_ATTRS ) {
-		stat = dev_attr_stat[i];
-		goto bail;
+
+	if ( val ) {
+		if ( IS_ERR( nam = fw_name_dup( prg ) ) ) {
+			return PTR_ERR( nam );
+		}
+		trace_fpga_prog_request( dev, "program", nam );
+		if ( (err = request_load( prg, nam, 0, opts, ! prg->async )) ) {
+			sz = err;
+		}
 	}
+	return sz;
+}
 
-	/* Add symlink to fpga_manager */
-	mgrObj = & mgr->dev.kobj;	
+/* Sysfs attribute 'autoload' (show)
+ */
+static ssize_t
+autoload_show(struct device *dev, struct device_attribute *att, char *buf)
+{
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
 
-	kobject_get( mgrObj );
+	if ( FPGA_PROG_AUTOLOAD_IF_UNCONFIGURED == prg->autoload ) {
+		return snprintf(buf, PAGE_SIZE, "if-unconfigured\n");
+	}
+	/* dont see how that can overflow PAGE_SIZE */
+	return snprintf(buf, PAGE_SIZE, "%d\n", prg->autoload);
+}
 
-	stat = sysfs_create_link( &pdev->dev.kobj, mgrObj, "fpga_manager" );
+/* Sysfs attribute 'autoload' (store)
+ */
+static ssize_t
+autoload_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz)
+{
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
 
-	kobject_put( mgrObj );
+	if ( autoload_parse( buf, &prg->autoload ) ) {
+		return -EINVAL;
+	}
+
+	return sz;
+}
+
+/* Sysfs attribute 'async' (show)
+ */
+static ssize_t
+async_show(struct device *dev, struct device_attribute *att, char *buf)
+{
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
+
+	return snprintf(buf, PAGE_SIZE, "%d\n", prg->async);
+}
+
+/* Sysfs attribute 'async' (store)
+ */
+static ssize_t
+async_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz)
+{
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
+
+	if ( kstrtoint(buf, 0, &prg->async) ) {
+		return -EINVAL;
+	}
+
+	return sz;
+}
+
+/* Sysfs attribute 'state' (show)
+ */
+static ssize_t
+state_show(struct device *dev, struct device_attribute *att, char *buf)
+{
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
+enum fpga_prog_state     state;
+int                      err;
+
+	spin_lock( &prg->lock );
+	state = prg->state;
+	err   = prg->err;
+	spin_unlock( &prg->lock );
+
+	return snprintf(buf, PAGE_SIZE, "%s %d\n", state_names[state], err);
+}
+
+/* Character device
+ */
+
+/* Per-open state of the character device
+ */
+struct fpga_prog_file {
+	struct fpga_prog_drvdat *prg;
+	struct fpga_prog_img     img;
+	/* sticky write error; a partial image is never programmed */
+	int                      err;
+};
+
+static int
+fpga_prog_open(struct inode *inode, struct file *filp)
+{
+struct miscdevice       *misc = filp->private_data;
+struct fpga_prog_drvdat *prg  = container_of( misc, struct fpga_prog_drvdat, misc );
+struct fpga_prog_file   *pf;
+
+	/* Only one writer at a time */
+	if ( atomic_cmpxchg( &prg->misc_busy, 0, 1 ) ) {
+		return -EBUSY;
+	}
+
+	if ( ! (pf = kzalloc( sizeof(*pf), GFP_KERNEL )) ) {
+		atomic_set( &prg->misc_busy, 0 );
+		return -ENOMEM;
+	}
+
+	/* misc_deregister() serializes against open, i.e., the
+	 * drvdat is still alive here.
+	 */
+	kref_get( &prg->ref );
+
+	pf->prg            = prg;
+	filp->private_data = pf;
+
+	return nonseekable_open( inode, filp );
+}
+
+static ssize_t
+fpga_prog_write(struct file *filp, const char __user *ubuf, size_t len, loff_t *ppos)
+{
+struct fpga_prog_file *pf = filp->private_data;
+ssize_t                rval;
+
+	if ( pf->err ) {
+		return pf->err;
+	}
+
+	if ( 0 == pf->img.size ) {
+		img_hash_start( &pf->img );
+	}
+
+	if ( (rval = img_write_user( &pf->img, ubuf, len )) < 0 ) {
+		pf->err = rval;
+	}
+
+	return rval;
+}
+
+/* Programming is triggered when the file is closed so that
+ * the status can be returned to the user.
+ */
+static int
+fpga_prog_flush(struct file *filp, fl_owner_t id)
+{
+struct fpga_prog_file *pf = filp->private_data;
+int                    err;
+
+	if ( pf->err ) {
+		err = pf->err;
+	} else if ( pf->img.size ) {
+		struct fpga_prog_src src = { .img = &pf->img };
+
+		img_hash_final( &pf->img );
+
+		trace_fpga_prog_request( &pf->prg->pdev->dev, "cdev", 0 );
+
+		err = request_load( pf->prg, 0, &src, 0, 1 );
+	} else {
+		return 0;
+	}
+
+	/* Discard the image once it has been consumed */
+	img_free( &pf->img );
+	pf->err = 0;
+
+	return err;
+}
+
+static long
+fpga_prog_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+struct fpga_prog_file     *pf = filp->private_data;
+struct fpga_prog_load_fd   lfd;
+struct fpga_prog_load_user lu;
+int                        err;
+
+	switch ( cmd ) {
+		case FPGA_PROG_IOC_LOAD_FD:
+			if ( copy_from_user( &lfd, (void __user *)arg, sizeof(lfd) ) ) {
+				return -EFAULT;
+			}
+			if ( lfd.flags ) {
+				return -EINVAL;
+			}
+			trace_fpga_prog_request( &pf->prg->pdev->dev, "fd", 0 );
+			return load_from_fd( pf->prg, &lfd );
+
+		case FPGA_PROG_IOC_LOAD_USER:
+			if ( copy_from_user( &lu, (void __user *)arg, sizeof(lu) ) ) {
+				return -EFAULT;
+			}
+			if ( lu.flags ) {
+				return -EINVAL;
+			}
+			trace_fpga_prog_request( &pf->prg->pdev->dev, "user", 0 );
+			err = load_user( pf->prg, &lu );
+			/* report the timing even if programming failed */
+			if ( copy_to_user( (void __user *)arg, &lu, sizeof(lu) ) && ! err ) {
+				err = -EFAULT;
+			}
+			return err;
+
+		default:
+			break;
+	}
+
+	return -ENOTTY;
+}
+
+static int
+fpga_prog_release(struct inode *inode, struct file *filp)
+{
+struct fpga_prog_file   *pf  = filp->private_data;
+struct fpga_prog_drvdat *prg = pf->prg;
+
+	img_free( &pf->img );
+	kfree( pf );
+
+	atomic_set( &prg->misc_busy, 0 );
+	put_drvdat( prg );
+
+	return 0;
+}
+
+static const struct file_operations fpga_prog_fops = {
+	.owner          = THIS_MODULE,
+	.open           = fpga_prog_open,
+	.write          = fpga_prog_write,
+	.flush          = fpga_prog_flush,
+	.release        = fpga_prog_release,
+	.unlocked_ioctl = fpga_prog_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,5,0)
+	/* the ioctl structs have the same layout on 32 and 64 bits */
+	.compat_ioctl   = compat_ptr_ioctl,
+#else
+	.compat_ioctl   = fpga_prog_ioctl,
+#endif
+	/* not seekable: see nonseekable_open() */
+};
+
+static int
+prog_misc_register(struct fpga_prog_drvdat *prg)
+{
+int stat;
+
+	if ( (prg->misc_id = ida_simple_get( &fpga_prog_cdev_ida, 0, 0, GFP_KERNEL )) < 0 ) {
+		return prg->misc_id;
+	}
+
+	prg->misc.minor  = MISC_DYNAMIC_MINOR;
+	prg->misc.fops   = &fpga_prog_fops;
+	prg->misc.parent = &prg->pdev->dev;
+	prg->misc.mode   = 0600;
+	prg->misc.name   = kasprintf( GFP_KERNEL, "fpga-prog%d", prg->misc_id );
+
+	if ( ! prg->misc.name ) {
+		stat = -ENOMEM;
+	} else {
+		stat = misc_register( &prg->misc );
+	}
 
 	if ( stat ) {
-		goto bail;
+		kfree( prg->misc.name );
+		prg->misc.name = 0;
+		ida_simple_remove( &fpga_prog_cdev_ida, prg->misc_id );
+		prg->misc_id   = -1;
+	}
+
+	return stat;
+}
+
+static void
+prog_misc_deregister(struct fpga_prog_drvdat *prg)
+{
+	/* An open file can no longer program once we are
+	 * detached (see jobs_shutdown()).
+	 */
+	misc_deregister( &prg->misc );
+
+	kfree( prg->misc.name );
+	prg->misc.name = 0;
+	ida_simple_remove( &fpga_prog_cdev_ida, prg->misc_id );
+	prg->misc_id   = -1;
+}
+
+/* Sysfs attribute 'skip_identical' (show)
+ */
+static ssize_t
+skip_identical_show(struct device *dev, struct device_attribute *att, char *buf)
+{
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
+
+	return snprintf(buf, PAGE_SIZE, "%d\n", prg->skip_identical);
+}
+
+/* Sysfs attribute 'skip_identical' (store)
+ */
+static ssize_t
+skip_identical_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz)
+{
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
+
+	if ( kstrtoint(buf, 0, &prg->skip_identical) ) {
+		return -EINVAL;
+	}
+
+	return sz;
+}
+
+/* Sysfs attribute 'digest' (show)
+ */
+static ssize_t
+digest_show(struct device *dev, struct device_attribute *att, char *buf)
+{
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
+u8                       digest[FPGA_PROG_DIGEST_SIZE];
+int                      valid;
+
+	spin_lock( &prg->lock );
+	valid = prg->digest_valid;
+	memcpy( digest, prg->digest, sizeof(digest) );
+	spin_unlock( &prg->lock );
+
+	if ( ! valid ) {
+		return snprintf(buf, PAGE_SIZE, "\n");
+	}
+
+	return snprintf(buf, PAGE_SIZE, "%*phN\n", FPGA_PROG_DIGEST_SIZE, digest);
+}
+
+/* Sysfs attribute 'last_load' (show)
+ */
+static ssize_t
+last_load_show(struct device *dev, struct device_attribute *att, char *buf)
+{
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
+u8                       digest[FPGA_PROG_DIGEST_SIZE];
+int                      valid;
+size_t                   size;
+u64                      t;
+u32                      ns;
+
+	spin_lock( &prg->lock );
+	valid = prg->last_digest_valid;
+	memcpy( digest, prg->last_digest, sizeof(digest) );
+	size  = prg->last_loaded;
+	t     = prg->last_time_ns;
+	spin_unlock( &prg->lock );
+
+	if ( ! t ) {
+		return snprintf(buf, PAGE_SIZE, "\n");
+	}
+
+	t = div_u64_rem( t, NSEC_PER_SEC, &ns );
+
+	if ( ! valid ) {
+		return snprintf(buf, PAGE_SIZE, "- %zu %llu.%09u\n", size, (unsigned long long)t, ns);
+	}
+
+	return snprintf(buf, PAGE_SIZE, "%*phN %zu %llu.%09u\n", FPGA_PROG_DIGEST_SIZE, digest, size, (unsigned long long)t, ns);
+}
+
+/* Sysfs attributes 'stats/<phase>' (show)
+ */
+static ssize_t
+stats_show(struct device *dev, struct device_attribute *att, char *buf)
+{
+struct fpga_prog_drvdat *prg   = get_drvdat( dev );
+enum fpga_prog_phase     phase = (enum fpga_prog_phase)(unsigned long)container_of( att, struct dev_ext_attribute, attr )->var;
+struct fpga_prog_lat     lat;
+
+	spin_lock( &prg->lock );
+	lat = prg->stats[phase];
+	spin_unlock( &prg->lock );
+
+	return snprintf(buf, PAGE_SIZE, "%llu %llu %llu %llu %llu\n",
+	                (unsigned long long) lat.count,
+	                (unsigned long long) div_u64( lat.last, NSEC_PER_USEC ),
+	                (unsigned long long) div_u64( lat.min,  NSEC_PER_USEC ),
+	                (unsigned long long) div_u64( lat.max,  NSEC_PER_USEC ),
+	                (unsigned long long) (lat.count ? div64_u64( lat.sum, lat.count * NSEC_PER_USEC ) : 0));
+}
+
+/* Sysfs attributes 'stats/<phase>_hist' (show)
+ */
+static ssize_t
+stats_hist_show(struct device *dev, struct device_attribute *att, char *buf)
+{
+struct fpga_prog_drvdat *prg   = get_drvdat( dev );
+enum fpga_prog_phase     phase = (enum fpga_prog_phase)(unsigned long)container_of( att, struct dev_ext_attribute, attr )->var;
+u32                      hist[FPGA_PROG_HIST_BINS];
+int                      i, len = 0;
+
+	spin_lock( &prg->lock );
+	memcpy( hist, prg->stats[phase].hist, sizeof(hist) );
+	spin_unlock( &prg->lock );
+
+	for ( i=0; i<FPGA_PROG_HIST_BINS; i++ ) {
+		len += snprintf( buf + len, PAGE_SIZE - len, "%u%c", hist[i], i < FPGA_PROG_HIST_BINS - 1 ? ' ' : '\n' );
+	}
+
+	return len;
+}
+
+/* Sysfs attribute 'stats/reset' (store)
+ */
+static ssize_t
+stats_reset_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz)
+{
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
+int                      val;
+
+	if ( kstrtoint(buf, 0, &val) ) {
+		return -EINVAL;
+	}
+
+	if ( val ) {
+		spin_lock( &prg->lock );
+		memset( prg->stats, 0, sizeof(prg->stats) );
+		prg->last_stored = 0;
+		prg->last_loaded = 0;
+		spin_unlock( &prg->lock );
+	}
+
+	return sz;
+}
+
+/* Sysfs attribute 'flags' (show)
+ */
+static ssize_t
+flags_show(struct device *dev, struct device_attribute *att, char *buf)
+{
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
+
+	return snprintf(buf, PAGE_SIZE, "0x%x\n", (unsigned)prg->info.flags);
+}
+
+/* Sysfs attribute 'flags' (store)
+ */
+static ssize_t
+flags_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz)
+{
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
+u32                      val;
+
+	if ( kstrtou32(buf, 0, &val) ) {
+		return -EINVAL;
 	}
 
-	dev_attr_stat[0] = -1;
-	mem              = 0;
+	mutex_lock( &prg->mutex );
+	prg->info.flags = val;
+	mutex_unlock( &prg->mutex );
 
-bail:
-	for ( i=0; i < N_DEV_ATTRS && dev_attr_stat[i] == 0; i++ ) {
-		device_remove_file( &pdev->dev, dev_attrs[i] );
-	}
+	return sz;
+}
 
-	if ( mem )
-		release_drvdat( mem );
+/* Sysfs attribute 'partial_images' (show)
+ */
+static ssize_t
+partial_images_show(struct device *dev, struct device_attribute *att, char *buf)
+{
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
+struct fpga_prog_part   *part;
+int                      len = 0;
 
-	return stat;
+	mutex_lock( &prg->mutex );
+	list_for_each_entry( part, &prg->parts, list ) {
+		len += snprintf(buf + len, PAGE_SIZE - len, "%s %s\n", part->name, part->path);
+		if ( len >= PAGE_SIZE ) {
+			len = PAGE_SIZE - 1;
+			break;
+		}
+	}
+	mutex_unlock( &prg->mutex );
+
+	return len;
 }
 
-/* Driver probe function
+/* Sysfs attribute 'partial_images' (store)
+ *
+ * 'name path' adds/replaces an entry, '-name' removes it.
  */
-static int
-fpga_prog_probe(struct platform_device *pdev)
+static ssize_t
+partial_images_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz)
 {
-struct fpga_manager     *mgr;
-struct device_node      *mgrNode;
-int                      stat, fwstat;
-struct fpga_prog_drvdat *prg;
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
+struct fpga_prog_part   *part;
+char                    *str, *nam, *path;
+int                      err = 0;
 
-	/* Locate an fpga_manager for this device */
-	mgr = of_get_mgr_from_pdev( pdev, &mgrNode );
-	if ( IS_ERR( mgr ) ) {
-		printk(KERN_ERR "%s: no fpga-manager found (%ld)\n", drvnam, PTR_ERR(mgr));
-		return PTR_ERR( mgr );
+	if ( ! (str = kstrndup( buf, sz, GFP_KERNEL )) ) {
+		return -ENOMEM;
 	}
 
-	/* dev_attach() 'consumes' the reference to mgrNode -
-	 * either by storing in drvdat or releasing it on failure
-	 */
-	stat = dev_attach( pdev, mgr, mgrNode );
+	path = strim( str );
+	nam  = strsep( &path, " \t" );
+	if ( path ) {
+		path = skip_spaces( path );
+	}
 
-	if ( 0 == stat ) {
-		/* If - after successfully attaching to the device we
-		 * have enough information then we can attempt to load
-		 * firmware.
-		 */
-		prg = platform_get_drvdata( pdev );
-		if ( prg->FW_NAME && prg->autoload ) {
-#if defined(HAS_NEW_API)
-			fwstat = fpga_mgr_load( mgr, &prg->info );
-#else
-			fwstat = fpga_mgr_firmware_load( mgr, &prg->info, prg->FW_NAME );
-#endif
-			if ( fwstat ) {
-				printk(KERN_WARNING "%s: programming firmware failed (%d)\n", drvnam, fwstat);
-			}
+	mutex_lock( &prg->mutex );
+	if ( '-' == nam[0] ) {
+		if ( path || ! (part = part_find( prg, nam + 1 )) ) {
+			err = -ENOENT;
+		} else {
+			part_free( part );
 		}
+	} else if ( ! nam[0] || ! path || ! path[0] ) {
+		err = -EINVAL;
+	} else {
+		err = part_set( prg, nam, path );
 	}
+	mutex_unlock( &prg->mutex );
 
-	/* Release manager */
-	fpga_mgr_put( mgr );
+	kfree( str );
 
-	return stat;
+	return err ? err : sz;
 }
 
-/* Cleanup driver private data
+/* Sysfs attribute 'region' (show)
  */
-static void
-release_drvdat(struct fpga_prog_drvdat *prg)
+static ssize_t
+region_show(struct device *dev, struct device_attribute *att, char *buf)
 {
-	if ( prg->mgrNode ) {
-		of_node_put( prg->mgrNode );
-	}
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
+int                      len = 0;
 
-	if ( prg->FW_NAME ) {
-		kfree( prg->FW_NAME );
-		prg->FW_NAME = 0;
+	spin_lock( &prg->lock );
+	if ( prg->region ) {
+		len = snprintf(buf, PAGE_SIZE, "%s\n", prg->region);
 	}
+	spin_unlock( &prg->lock );
 
-	kfree( prg );
+	return len;
 }
 
-/* Driver remove function
+/* Sysfs attribute 'region' (store); load a partial image
  */
-static int
-fpga_prog_remove(struct platform_device *pdev)
+static ssize_t
+region_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz)
 {
-struct fpga_prog_drvdat *prg = platform_get_drvdata( pdev );
-int                      i;
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
+char                    *req;
+int                      err;
 
-	for ( i=0; i < N_DEV_ATTRS; i++ ) {
-		device_remove_file( &pdev->dev, dev_attrs[i] );
+	if ( ! (req = kstrndup( buf, sz, GFP_KERNEL )) ) {
+		return -ENOMEM;
+	}
+	/* drop the trailing newline (if any) */
+	req[ strcspn( req, "\n" ) ] = 0;
+	if ( ! req[0] ) {
+		kfree( req );
+		return -EINVAL;
 	}
 
-	sysfs_remove_link( &pdev->dev.kobj, "fpga_manager" );
+	trace_fpga_prog_request( dev, "region", req );
 
-	release_drvdat( prg );
+	if ( (err = request_load( prg, req, 0, FPGA_PROG_OPT_PARTIAL, ! prg->async )) ) {
+		sz = err;
+	}
 
-	return 0;
+	return sz;
 }
 
-/* Add a 'soft' device (support 'remove' device attribute in sysfs)
+/* Sysfs attribute 'expected_part' (show)
  */
 static ssize_t
-add_programmer_store(struct device_driver *drv, const char *buf, size_t sz)
+expected_part_show(struct device *dev, struct device_attribute *att, char *buf)
 {
-struct fpga_manager     *mgr;
-int                      stat;
-struct device           *dev;
-struct device_node      *mgrNode = 0;
-
-	if ( buf[sz] )
-		return -EINVAL;
-
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
+int                      len = 0;
 
-	if ( sz > PAGE_SIZE - 1 ) {
-		return -ENOMEM;
+	spin_lock( &prg->lock );
+	if ( prg->expected_part[0] ) {
+		len = snprintf(buf, PAGE_SIZE, "%s\n", prg->expected_part);
 	}
+	spin_unlock( &prg->lock );
 
-	mgr = of_get_mgr_from_path( buf, &mgrNode );
+	return len;
+}
 
-	if ( IS_ERR( mgr ) ) {
-		return PTR_ERR( mgr );
-	}
-	/* Hold refs to manager and mgrNode here */
+/* Sysfs attribute 'expected_part' (store)
+ */
+static ssize_t
+expected_part_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz)
+{
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
+char                     part[FPGA_PROG_PART_MAX];
+size_t                   len = strcspn( buf, "\n" );
 
-	if ( (dev = device_find_child( &platform_bus, mgrNode , cmp_release_func )) ) {
-		put_device  ( dev     );
-		fpga_mgr_put( mgr     );
-		of_node_put ( mgrNode );
-		stat = -EEXIST;
-	} else {
-		/* create_pdev takes over the manager and mgrNode references
-		 */
-		stat = create_pdev( mgr, mgrNode );
+	if ( len >= sizeof(part) ) {
+		return -EINVAL;
 	}
+	memcpy( part, buf, len );
+	part[len] = 0;
 
-	if ( stat ) {
-		sz = stat;
-	}
+	spin_lock( &prg->lock );
+	memcpy( prg->expected_part, part, sizeof(part) );
+	spin_unlock( &prg->lock );
 
 	return sz;
 }
 
-/* Remove a 'soft' device (support 'remove' device attribute in sysfs)
+/* Sysfs attribute 'bit_swap' (show)
  */
 static ssize_t
-remove_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz)
+bit_swap_show(struct device *dev, struct device_attribute *att, char *buf)
 {
-int val;
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
 
-	if ( kstrtoint(buf, 0, &val) ) {
-		return -EINVAL;
-	}
+	return snprintf(buf, PAGE_SIZE, "%d\n", prg->bit_swap);
+}
 
-	if ( val && device_remove_file_self( dev, att ) ) {
-		device_unregister( dev );
+/* Sysfs attribute 'bit_swap' (store)
+ */
+static ssize_t
+bit_swap_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz)
+{
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
+
+	if ( kstrtoint(buf, 0, &prg->bit_swap) ) {
+		return -EINVAL;
 	}
 
 	return sz;
 }
 
-/* Helper to find driver-private data
+/* Sysfs attribute 'loader' (show)
  */
-static struct fpga_prog_drvdat *
-get_drvdat(struct device *dev)
+static ssize_t
+loader_show(struct device *dev, struct device_attribute *att, char *buf)
 {
-struct platform_device *pdev = container_of( dev, struct platform_device, dev );
-	return (struct fpga_prog_drvdat*) platform_get_drvdata( pdev );
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
+
+	return snprintf(buf, PAGE_SIZE, "%s\n", loader_names[ prg->loader ]);
 }
 
-/* Sysfs attribute 'file' (store)
+/* Sysfs attribute 'loader' (store)
  */
 static ssize_t
-file_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz)
+loader_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz)
 {
 struct fpga_prog_drvdat *prg = get_drvdat( dev );
-int    err;
+int                      i;
 
-	if ( prg->FW_NAME ) {
-		kfree( prg->FW_NAME );
-        prg->FW_NAME = 0;
+	if ( (i = sysfs_match_string( loader_names, buf )) < 0 ) {
+		return -EINVAL;
 	}
 
-	prg->FW_NAME = kstrdup( buf, GFP_KERNEL );
-	if ( ! prg->FW_NAME ) {
-		return -ENOMEM;
-	} else {
-		if ( prg->autoload && (err = load_fw( prg ) ) ) {
-			sz = err;
-		}
-	}
+	prg->loader = i;
+
 	return sz;
 }
 
-/* Sysfs attribute 'file' (show)
+/* Sysfs attribute 'priority' (show)
  */
 static ssize_t
-file_show(struct device *dev, struct device_attribute *att, char *buf)
+priority_show(struct device *dev, struct device_attribute *att, char *buf)
 {
 struct fpga_prog_drvdat *prg = get_drvdat( dev );
-int                   len;
 
-	if ( ! prg->FW_NAME ) {
-		buf[0] = 0;
-		len    = 0;
-	} else {
-		len = snprintf(buf, PAGE_SIZE, "%s", prg->FW_NAME);
-		if ( len >= PAGE_SIZE )
-			len = PAGE_SIZE - 1;
-	}
-	return len;
+	return snprintf(buf, PAGE_SIZE, "%d\n", READ_ONCE( prg->priority ));
 }
 
-/* Sysfs attribute 'program' (store)
+/* Sysfs attribute 'priority' (store)
  */
 static ssize_t
-program_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz)
+priority_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz)
 {
 struct fpga_prog_drvdat *prg = get_drvdat( dev );
-int                   val;
-int                   err;
+int                      val;
 
 	if ( kstrtoint(buf, 0, &val) ) {
 		return -EINVAL;
 	}
 
-	if ( val ) {
-		if ( (err = load_fw( prg )) ) {
-			sz = err;
-		}
+	WRITE_ONCE( prg->priority, val );
+
+	return sz;
+}
+
+/* Sysfs attribute 'cancel' (store); cancels the pending job and
+ * a load waiting for its turn (but not a load in progress).
+ */
+static ssize_t
+cancel_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz)
+{
+struct fpga_prog_drvdat *prg    = get_drvdat( dev );
+struct fpga_prog_job    *job;
+int                      notify = 0;
+int                      val;
+
+	if ( kstrtoint(buf, 0, &val) ) {
+		return -EINVAL;
+	}
+
+	if ( ! val ) {
+		return sz;
+	}
+
+	trace_fpga_prog_request( dev, "cancel", 0 );
+
+	spin_lock( &prg->lock );
+	job       = prg->pend;
+	prg->pend = 0;
+	if ( job && FPGA_PROG_QUEUED == prg->state ) {
+		prg->state = FPGA_PROG_ERROR;
+		prg->err   = -ECANCELED;
+		notify     = 1;
+	}
+	spin_unlock( &prg->lock );
+
+	if ( notify ) {
+		sysfs_notify( &prg->pdev->dev.kobj, 0, "state" );
+	}
+
+	if ( job ) {
+		job_finish( job, -ECANCELED );
 	}
+
+	if ( ! sched_cancel( prg ) && ! job ) {
+		return -ENOENT;
+	}
+
 	return sz;
 }
 
-/* Sysfs attribute 'autoload' (show)
+/* Sysfs attribute 'stage' (show)
  */
 static ssize_t
-autoload_show(struct device *dev, struct device_attribute *att, char *buf)
+stage_show(struct device *dev, struct device_attribute *att, char *buf)
 {
 struct fpga_prog_drvdat *prg = get_drvdat( dev );
+struct fpga_prog_src    *src;
+int                      len = 0;
+
+	mutex_lock( &prg->mutex );
+	if ( prg->staged ) {
+		src = &prg->staged->src;
+		len = snprintf(buf, PAGE_SIZE, "%s %zu\n", prg->staged->name, src->img ? src->img->size : src->count);
+		if ( len >= PAGE_SIZE ) {
+			len = PAGE_SIZE - 1;
+		}
+	}
+	mutex_unlock( &prg->mutex );
 
-	/* dont see how that can overflow PAGE_SIZE */
-	return snprintf(buf, PAGE_SIZE, "%d\n", prg->autoload);
+	return len;
 }
 
-/* Sysfs attribute 'autoload' (store)
+/* Sysfs attribute 'stage' (store); fetch an image ahead of
+ * time or drop the staged image (empty line).
  */
 static ssize_t
-autoload_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz)
+stage_store(struct device *dev, struct device_attribute *att, const char *buf, size_t sz)
 {
-struct fpga_prog_drvdat *prg = get_drvdat( dev );
+struct fpga_prog_drvdat  *prg = get_drvdat( dev );
+struct fpga_prog_fetched *fet = 0;
+char                     *nam;
+int                       err;
 
-	if ( kstrtoint(buf, 0, &prg->autoload) ) {
-		return -EINVAL;
+	if ( ! (nam = kstrndup( buf, sz, GFP_KERNEL )) ) {
+		return -ENOMEM;
+	}
+	/* drop the trailing newline (if any) */
+	nam[ strcspn( nam, "\n" ) ] = 0;
+
+	if ( nam[0] ) {
+		trace_fpga_prog_request( dev, "stage", nam );
+
+		if ( ! (fet = kmalloc( sizeof(*fet), GFP_KERNEL )) ) {
+			kfree( nam );
+			return -ENOMEM;
+		}
+		/* fetch without holding the mutex; programming may proceed meanwhile */
+		if ( (err = fetch_image( prg, nam, fet )) ) {
+			kfree( fet );
+			kfree( nam );
+			return err;
+		}
+		fet->name = nam;
+	} else {
+		kfree( nam );
+	}
+
+	mutex_lock( &prg->mutex );
+	swap( fet, prg->staged );
+	mutex_unlock( &prg->mutex );
+
+	if ( fet ) {
+		fetched_release( fet );
+		kfree( fet );
 	}
 
 	return sz;
 }
 
+/* Sysfs attribute 'stats/image' (show)
+ */
+static ssize_t
+stats_image_show(struct device *dev, struct device_attribute *att, char *buf)
+{
+struct fpga_prog_drvdat *prg = get_drvdat( dev );
+size_t                   stored, loaded;
+
+	spin_lock( &prg->lock );
+	stored = prg->last_stored;
+	loaded = prg->last_loaded;
+	spin_unlock( &prg->lock );
+
+	return snprintf(buf, PAGE_SIZE, "%zu %zu\n", stored, loaded);
+}
+
 /* Boilerplate
  */
 #ifdef CONFIG_OF
@@ -874,13 +6406,76 @@ static int __init
 fpga_prog_init(void)
 {
 int                    err     = 0;
+int                    i;
+
+	if ( ! (fpga_prog_wq = alloc_workqueue( "fpga_prog", WQ_UNBOUND, 0 )) ) {
+		return -ENOMEM;
+	}
+
+	if ( ! (fpga_prog_manifest_wq = alloc_workqueue( "fpga_prog_manifest", WQ_UNBOUND, manifest_workers )) ) {
+		destroy_workqueue( fpga_prog_wq );
+		return -ENOMEM;
+	}
+
+	if ( (err = cache_init()) ) {
+		destroy_workqueue( fpga_prog_manifest_wq );
+		destroy_workqueue( fpga_prog_wq );
+		return err;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
+	if ( async_probe ) {
+		fpga_prog_driver.driver.probe_type = PROBE_PREFER_ASYNCHRONOUS;
+	}
+#endif
+
+	/* Without a digest we just never skip programming */
+	digest_tfm = crypto_alloc_shash( "sha256", 0, 0 );
+	if ( IS_ERR( digest_tfm ) ) {
+#ifndef MODULE
+		/* built-in and sha256 not registered yet (older kernels register
+		 * the algorithms at module_init level); see fpga_prog_late_init()
+		 */
+		if ( -ENOENT == PTR_ERR( digest_tfm ) ) {
+			printk(KERN_INFO "%s: sha256 not available yet; loads at boot have no digest\n", drvnam);
+		} else {
+			printk(KERN_WARNING "%s: no sha256 available (%ld); digests not supported\n", drvnam, PTR_ERR( digest_tfm ));
+		}
+#else
+		printk(KERN_WARNING "%s: no sha256 available (%ld); digests not supported\n", drvnam, PTR_ERR( digest_tfm ));
+#endif
+		digest_tfm = 0;
+	}
 
 	err = platform_driver_register( &fpga_prog_driver );
 
 	if ( ! err ) {
-		if ( (err = driver_create_file( &fpga_prog_driver.driver, &driver_attr_add_programmer )) ) {
-			platform_driver_unregister( &fpga_prog_driver );
+		for ( i=0; i<N_DRV_ATTRS; i++ ) {
+			if ( (err = driver_create_file( &fpga_prog_driver.driver, drv_attrs[i] )) ) {
+				while ( --i >= 0 ) {
+					driver_remove_file( &fpga_prog_driver.driver, drv_attrs[i] );
+				}
+				platform_driver_unregister( &fpga_prog_driver );
+				break;
+			}
+		}
+	}
+
+	if ( ! err && autodiscover ) {
+		/* let programmers from the device tree claim their managers first */
+		if ( async_probe ) {
+			wait_for_device_probe();
+		}
+		discover_mgrs( 0 );
+	}
+
+	if ( err ) {
+		if ( digest_tfm ) {
+			crypto_free_shash( digest_tfm );
 		}
+		cache_exit();
+		destroy_workqueue( fpga_prog_manifest_wq );
+		destroy_workqueue( fpga_prog_wq );
 	}
 
 	return err;
@@ -889,8 +6484,67 @@ int                    err     = 0;
 static void
 fpga_prog_exit(void)
 {
+int i;
+
+	/* Manifest jobs use the driver; entries which have not started
+	 * yet fail without programming, running ones are waited for.
+	 */
+	mutex_lock( &manifest_mutex );
+	if ( manifest ) {
+		spin_lock( &manifest->lock );
+		for ( i=0; i<manifest->nent; i++ ) {
+			manifest->ent[i].dep_err = -ECANCELED;
+		}
+		spin_unlock( &manifest->lock );
+	}
+	mutex_unlock( &manifest_mutex );
+
+	destroy_workqueue( fpga_prog_manifest_wq );
+	if ( manifest ) {
+		manifest_free( manifest );
+		manifest = 0;
+	}
+
 	platform_driver_unregister( &fpga_prog_driver );
+	if ( digest_tfm ) {
+		crypto_free_shash( digest_tfm );
+	}
+	cache_exit();
+	destroy_workqueue( fpga_prog_wq );
+	kfree( add_programmer_res );
 }
 
+#ifdef MODULE
 module_init( fpga_prog_init );
+#else
+/* Retry allocating the digest if sha256 was not registered when
+ * fpga_prog_init() ran
+ */
+static int __init
+fpga_prog_late_init(void)
+{
+struct crypto_shash *tfm;
+
+	if ( digest_tfm ) {
+		return 0;
+	}
+	tfm = crypto_alloc_shash( "sha256", 0, 0 );
+	if ( IS_ERR( tfm ) ) {
+		printk(KERN_WARNING "%s: no sha256 available (%ld); digests not supported\n", drvnam, PTR_ERR( tfm ));
+		return 0;
+	}
+	WRITE_ONCE( digest_tfm, tfm );
+	return 0;
+}
+
+late_initcall( fpga_prog_late_init );
+
+/* Built-in: register early so that the FPGA (e.g., from a 'memory-region')
+ * and the devices it implements can come up before the root file system
+ * is mounted. Probing is deferred until the manager shows up. '_sync'
+ * runs after algorithms registered at subsys_initcall level (recent
+ * kernels); otherwise the digest is only set up by fpga_prog_late_init().
+ */
+subsys_initcall_sync( fpga_prog_init );
+#endif
 module_exit( fpga_prog_exit );
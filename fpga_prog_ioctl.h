@@ -0,0 +1,59 @@
+/* Copyright Notice
+ * ================
+ * This file is part of the fpga_prog linux kernel module.
+ * It is subject to the license terms in the LICENSE.txt
+ * file found in the top-level directory of this distribution and at
+ * https://confluence.slac.stanford.edu/display/ppareg/LICENSE.html.
+ *
+ * No part of the software, including this file, may be copied, modified,
+ * propagated, or distributed except according to the terms contained in
+ * the LICENSE.txt file.
+ *
+ * Till Straumann <till.straumann@alumni.tu-berlin.de>, 2016-2023
+ */
+#ifndef FPGA_PROG_IOCTL_H
+#define FPGA_PROG_IOCTL_H
+
+/* ioctl interface of the /dev/fpga-progN character devices;
+ * this header is shared with userspace.
+ */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define FPGA_PROG_IOC_MAGIC 0xf9
+
+/* Program from a dma-buf or a memfd file descriptor. A memfd
+ * must be sealed against writing and shrinking (F_SEAL_WRITE,
+ * F_SEAL_SHRINK) so that the image cannot change while it is
+ * being programmed.
+ */
+struct fpga_prog_load_fd {
+	__s32 fd;
+	__u32 flags;    /* reserved; must be zero                    */
+	__u64 offset;   /* offset of the image in the buffer         */
+	__u64 length;   /* length of the image; 0: up to end of buf  */
+};
+
+#define FPGA_PROG_IOC_LOAD_FD _IOW( FPGA_PROG_IOC_MAGIC, 0x01, struct fpga_prog_load_fd )
+
+/* Program directly from user memory (e.g., an mmap()ed file or a
+ * hugepage buffer). The pages are pinned while the image is loaded;
+ * no copy is made. On return the durations of the phases are
+ * reported (nanoseconds; zero if a phase was not reached).
+ */
+struct fpga_prog_load_user {
+	__u64 addr;        /* address of the image                      */
+	__u64 length;      /* length of the image                       */
+	__u32 flags;       /* reserved; must be zero                    */
+	__u32 pad;
+	__u64 pin_ns;      /* out: pinning the pages                    */
+	__u64 acquire_ns;  /* out: obtaining the fpga_manager           */
+	__u64 load_ns;     /* out: the manager programming the device   */
+	__u64 total_ns;    /* out: the programming job (excl. pinning)  */
+	__u64 wait_ns;     /* out: waiting for the load scheduler       */
+};
+
+#define FPGA_PROG_IOC_LOAD_USER _IOWR( FPGA_PROG_IOC_MAGIC, 0x02, struct fpga_prog_load_user )
+
+#endif
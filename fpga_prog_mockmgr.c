@@ -0,0 +1,405 @@
+/* Copyright Notice
+ * ================
+ * This file is part of the fpga_prog linux kernel module.
+ * It is subject to the license terms in the LICENSE.txt
+ * file found in the top-level directory of this distribution and at
+ * https://confluence.slac.stanford.edu/display/ppareg/LICENSE.html.
+ *
+ * No part of the software, including this file, may be copied, modified,
+ * propagated, or distributed except according to the terms contained in
+ * the LICENSE.txt file.
+ *
+ * Till Straumann <till.straumann@alumni.tu-berlin.de>, 2016-2023
+ */
+
+/*
+ * Mock fpga_manager for testing and benchmarking fpga_prog without hardware.
+ *
+ * Loading this module creates 'num_mgrs' platform devices
+ *
+ *   /sys/bus/platform/devices/fpga-prog-mock.<n>/
+ *
+ * each of which registers a software fpga_manager. These managers have no
+ * device-tree node; fpga_prog refers to them by the name of the platform device:
+ *
+ *   echo -n fpga-prog-mock.0 > /sys/bus/platform/drivers/fpga_programmer/add_programmer
+ *
+ * The managers merely consume the image. Their behaviour is controlled by module
+ * parameters (which may be changed at run-time under /sys/module/fpga_prog_mockmgr/
+ * parameters/):
+ *
+ *   throughput:   simulated write throughput in kB/s (0: unlimited).
+ *   init_us:      latency of the 'write_init' phase (us).
+ *   write_us:     latency of each 'write' call (us; in addition to 'throughput').
+ *   complete_us:  latency of the 'write_complete' phase (us).
+ *   init_err,
+ *   write_err,
+ *   complete_err: errno returned by the respective phase (0: success); e.g.,
+ *                 setting 'write_err' to 5 makes every load fail with EIO.
+ *   init_state:   state the managers report when they are registered: 'unknown'
+ *                 (default) or 'operating' (simulates an FPGA configured by the
+ *                 bootloader; only settable when the module is loaded).
+ *
+ * The managers track their state: 'operating' after a successful load, the
+ * error state of the failing phase ('write init error', 'write error' or
+ * 'write complete error') otherwise.
+ *
+ * The attribute 'stats' of each mock device reports the number of loads, failed
+ * loads and the number of bytes written by the last load.
+ */
+
+#include <linux/module.h>
+#include <linux/printk.h>
+#include <linux/device.h>
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+#include <linux/delay.h>
+#include <linux/math64.h>
+#include <linux/fpga/fpga-mgr.h>
+#include <linux/version.h>
+
+MODULE_LICENSE("Dual BSD/GPL");
+
+#define MOCK_NAME     "fpga-prog-mock"
+#define MOCK_MAX_MGRS 4096
+
+static const char *drvnam = "fpga_prog_mockmgr";
+
+static unsigned int num_mgrs = 1;
+module_param( num_mgrs, uint, 0444 );
+MODULE_PARM_DESC( num_mgrs, "Number of mock managers to create" );
+
+static unsigned int throughput = 0;
+module_param( throughput, uint, 0644 );
+MODULE_PARM_DESC( throughput, "Simulated write throughput (kB/s; 0 = unlimited)" );
+
+static unsigned int init_us = 0;
+module_param( init_us, uint, 0644 );
+MODULE_PARM_DESC( init_us, "Latency of write_init (us)" );
+
+static unsigned int write_us = 0;
+module_param( write_us, uint, 0644 );
+MODULE_PARM_DESC( write_us, "Latency of each write (us)" );
+
+static unsigned int complete_us = 0;
+module_param( complete_us, uint, 0644 );
+MODULE_PARM_DESC( complete_us, "Latency of write_complete (us)" );
+
+static int init_err = 0;
+module_param( init_err, int, 0644 );
+MODULE_PARM_DESC( init_err, "errno returned by write_init (0 = success)" );
+
+static int write_err = 0;
+module_param( write_err, int, 0644 );
+MODULE_PARM_DESC( write_err, "errno returned by write (0 = success)" );
+
+static int complete_err = 0;
+module_param( complete_err, int, 0644 );
+MODULE_PARM_DESC( complete_err, "errno returned by write_complete (0 = success)" );
+
+static char *init_state = "unknown";
+module_param( init_state, charp, 0444 );
+MODULE_PARM_DESC( init_state, "Initial state of the managers ('unknown' or 'operating')" );
+
+static enum fpga_mgr_states mock_init_state = FPGA_MGR_STATE_UNKNOWN;
+
+struct mock_mgr {
+	struct fpga_manager *mgr;
+	spinlock_t           lock;
+	enum fpga_mgr_states state;
+	unsigned long        loads;
+	unsigned long        fails;
+	u64                  bytes;
+	u64                  last_bytes;
+};
+
+static struct platform_device **mock_pdevs;
+
+/* Parameters may be written with either sign; we return a negative errno
+ */
+static int
+mock_err(int err)
+{
+	return err > 0 ? -err : err;
+}
+
+static void
+mock_delay(u64 us)
+{
+	if ( 0 == us ) {
+		return;
+	}
+	if ( us >= 20000 ) {
+		msleep( (unsigned int)div_u64( us + 999, 1000 ) );
+	} else {
+		usleep_range( (unsigned long)us, (unsigned long)us + (unsigned long)us/8 + 1 );
+	}
+}
+
+static void
+mock_fail(struct mock_mgr *mock, enum fpga_mgr_states state)
+{
+	spin_lock( &mock->lock );
+	mock->fails++;
+	mock->state = state;
+	spin_unlock( &mock->lock );
+}
+
+static enum fpga_mgr_states
+mock_state(struct fpga_manager *mgr)
+{
+struct mock_mgr      *mock = mgr->priv;
+enum fpga_mgr_states  state;
+
+	spin_lock( &mock->lock );
+	state = mock->state;
+	spin_unlock( &mock->lock );
+
+	return state;
+}
+
+static int
+mock_write_init(struct fpga_manager *mgr, struct fpga_image_info *info, const char *buf, size_t count)
+{
+struct mock_mgr *mock = mgr->priv;
+int              err  = mock_err( READ_ONCE( init_err ) );
+
+	mock_delay( READ_ONCE( init_us ) );
+
+	spin_lock( &mock->lock );
+	mock->bytes = 0;
+	mock->state = FPGA_MGR_STATE_WRITE_INIT;
+	spin_unlock( &mock->lock );
+
+	if ( err ) {
+		mock_fail( mock, FPGA_MGR_STATE_WRITE_INIT_ERR );
+	}
+	return err;
+}
+
+static int
+mock_write(struct fpga_manager *mgr, const char *buf, size_t count)
+{
+struct mock_mgr *mock = mgr->priv;
+unsigned int     kbps = READ_ONCE( throughput );
+u64              us   = READ_ONCE( write_us );
+int              err  = mock_err( READ_ONCE( write_err ) );
+
+	/* kB/s == bytes/ms */
+	if ( kbps ) {
+		us += div_u64( (u64)count * 1000, kbps );
+	}
+	mock_delay( us );
+
+	if ( err ) {
+		mock_fail( mock, FPGA_MGR_STATE_WRITE_ERR );
+		return err;
+	}
+
+	spin_lock( &mock->lock );
+	mock->bytes += count;
+	mock->state  = FPGA_MGR_STATE_WRITE;
+	spin_unlock( &mock->lock );
+
+	return 0;
+}
+
+static int
+mock_write_complete(struct fpga_manager *mgr, struct fpga_image_info *info)
+{
+struct mock_mgr *mock = mgr->priv;
+int              err  = mock_err( READ_ONCE( complete_err ) );
+
+	mock_delay( READ_ONCE( complete_us ) );
+
+	if ( err ) {
+		mock_fail( mock, FPGA_MGR_STATE_WRITE_COMPLETE_ERR );
+		return err;
+	}
+
+	spin_lock( &mock->lock );
+	mock->loads++;
+	mock->last_bytes = mock->bytes;
+	mock->state      = FPGA_MGR_STATE_OPERATING;
+	spin_unlock( &mock->lock );
+
+	return 0;
+}
+
+static const struct fpga_manager_ops mock_ops = {
+	.state          = mock_state,
+	.write_init     = mock_write_init,
+	.write          = mock_write,
+	.write_complete = mock_write_complete,
+};
+
+static ssize_t
+stats_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+struct mock_mgr *mock = platform_get_drvdata( to_platform_device( dev ) );
+unsigned long    loads, fails;
+u64              bytes;
+
+	spin_lock( &mock->lock );
+	loads = mock->loads;
+	fails = mock->fails;
+	bytes = mock->last_bytes;
+	spin_unlock( &mock->lock );
+
+	return snprintf( buf, PAGE_SIZE, "%lu %lu %llu\n", loads, fails, (unsigned long long)bytes );
+}
+
+static DEVICE_ATTR_RO(stats);
+
+static int
+mock_probe(struct platform_device *pdev)
+{
+struct mock_mgr     *mock;
+struct fpga_manager *mgr;
+int                  stat;
+
+	if ( ! (mock = devm_kzalloc( &pdev->dev, sizeof(*mock), GFP_KERNEL )) ) {
+		return -ENOMEM;
+	}
+	spin_lock_init( &mock->lock );
+	/* the manager core reads the state when registering */
+	mock->state = mock_init_state;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+	mgr = devm_fpga_mgr_register( &pdev->dev, "fpga_prog mock manager", &mock_ops, mock );
+	if ( IS_ERR( mgr ) ) {
+		return PTR_ERR( mgr );
+	}
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,0,0)
+	mgr = devm_fpga_mgr_create( &pdev->dev, "fpga_prog mock manager", &mock_ops, mock );
+	if ( ! mgr ) {
+		return -ENOMEM;
+	}
+	if ( (stat = fpga_mgr_register( mgr )) ) {
+		return stat;
+	}
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,18,0)
+	mgr = fpga_mgr_create( &pdev->dev, "fpga_prog mock manager", &mock_ops, mock );
+	if ( ! mgr ) {
+		return -ENOMEM;
+	}
+	if ( (stat = fpga_mgr_register( mgr )) ) {
+		fpga_mgr_free( mgr );
+		return stat;
+	}
+#else
+	if ( (stat = fpga_mgr_register( &pdev->dev, "fpga_prog mock manager", &mock_ops, mock )) ) {
+		return stat;
+	}
+	mgr = 0;
+#endif
+	mock->mgr = mgr;
+
+	platform_set_drvdata( pdev, mock );
+
+	if ( (stat = device_create_file( &pdev->dev, &dev_attr_stats )) ) {
+		printk(KERN_WARNING "%s: unable to create 'stats' attribute (%d)\n", drvnam, stat);
+	}
+
+	return 0;
+}
+
+static int
+mock_remove(struct platform_device *pdev)
+{
+struct mock_mgr *mock = platform_get_drvdata( pdev );
+
+	device_remove_file( &pdev->dev, &dev_attr_stats );
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+	/* devres unregisters */
+	(void)mock;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,18,0)
+	fpga_mgr_unregister( mock->mgr );
+#else
+	(void)mock;
+	fpga_mgr_unregister( &pdev->dev );
+#endif
+	return 0;
+}
+
+static struct platform_device_id mock_ids[] = {
+	{ .name = MOCK_NAME },
+	{}
+};
+
+static struct platform_driver mock_driver = {
+	.driver = {
+		.name           = "fpga_prog_mockmgr",
+		.owner          = THIS_MODULE,
+	},
+	.id_table = mock_ids,
+	.probe    = mock_probe,
+	.remove   = mock_remove
+};
+
+static void
+mock_pdevs_unregister(void)
+{
+int i;
+
+	for ( i=num_mgrs-1; i>=0; i-- ) {
+		if ( mock_pdevs[i] ) {
+			platform_device_unregister( mock_pdevs[i] );
+		}
+	}
+	kfree( mock_pdevs );
+	mock_pdevs = 0;
+}
+
+static int __init
+mock_init(void)
+{
+int                     err;
+unsigned int            i;
+struct platform_device *pdev;
+
+	if ( num_mgrs > MOCK_MAX_MGRS ) {
+		printk(KERN_ERR "%s: at most %d managers supported\n", drvnam, MOCK_MAX_MGRS);
+		return -EINVAL;
+	}
+
+	if ( sysfs_streq( init_state, "operating" ) ) {
+		mock_init_state = FPGA_MGR_STATE_OPERATING;
+	} else if ( ! sysfs_streq( init_state, "unknown" ) ) {
+		printk(KERN_ERR "%s: invalid 'init_state' ('%s')\n", drvnam, init_state);
+		return -EINVAL;
+	}
+
+	if ( ! (mock_pdevs = kcalloc( num_mgrs, sizeof(*mock_pdevs), GFP_KERNEL )) ) {
+		return -ENOMEM;
+	}
+
+	if ( (err = platform_driver_register( &mock_driver )) ) {
+		kfree( mock_pdevs );
+		return err;
+	}
+
+	for ( i=0; i<num_mgrs; i++ ) {
+		pdev = platform_device_register_simple( MOCK_NAME, i, 0, 0 );
+		if ( IS_ERR( pdev ) ) {
+			err = PTR_ERR( pdev );
+			mock_pdevs_unregister();
+			platform_driver_unregister( &mock_driver );
+			return err;
+		}
+		mock_pdevs[i] = pdev;
+	}
+
+	return 0;
+}
+
+static void
+mock_exit(void)
+{
+	mock_pdevs_unregister();
+	platform_driver_unregister( &mock_driver );
+}
+
+module_init( mock_init );
+module_exit( mock_exit );
@@ -0,0 +1,159 @@
+/* Copyright Notice
+ * ================
+ * This file is part of the fpga_prog linux kernel module.
+ * It is subject to the license terms in the LICENSE.txt
+ * file found in the top-level directory of this distribution and at
+ * https://confluence.slac.stanford.edu/display/ppareg/LICENSE.html.
+ *
+ * No part of the software, including this file, may be copied, modified,
+ * propagated, or distributed except according to the terms contained in
+ * the LICENSE.txt file.
+ *
+ * Till Straumann <till.straumann@alumni.tu-berlin.de>, 2016-2023
+ */
+
+/* Tracepoints for the programming lifecycle; they can be enabled, e.g.,
+ *
+ *   echo 1 > /sys/kernel/tracing/events/fpga_prog/enable
+ *
+ * or used with 'perf'/'trace-cmd' (event group 'fpga_prog').
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM fpga_prog
+
+#if !defined(FPGA_PROG_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define FPGA_PROG_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/device.h>
+#include <linux/version.h>
+
+#ifndef fpga_prog_assign_str
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,10,0)
+#define fpga_prog_assign_str(dst, src) __assign_str( dst )
+#else
+#define fpga_prog_assign_str(dst, src) __assign_str( dst, src )
+#endif
+#endif
+
+/* A programming request arrived ('what' identifies the source) */
+TRACE_EVENT( fpga_prog_request,
+	TP_PROTO( struct device *dev, const char *what, const char *name ),
+	TP_ARGS( dev, what, name ),
+	TP_STRUCT__entry(
+		__string( dev,  dev_name( dev )    )
+		__string( what, what               )
+		__string( name, name ? name : ""   )
+	),
+	TP_fast_assign(
+		fpga_prog_assign_str( dev,  dev_name( dev )  );
+		fpga_prog_assign_str( what, what             );
+		fpga_prog_assign_str( name, name ? name : "" );
+	),
+	TP_printk( "%s: %s '%s'", __get_str( dev ), __get_str( what ), __get_str( name ) )
+);
+
+/* Autoload of the configured image when the driver is bound */
+TRACE_EVENT( fpga_prog_autoload,
+	TP_PROTO( struct device *dev, const char *name ),
+	TP_ARGS( dev, name ),
+	TP_STRUCT__entry(
+		__string( dev,  dev_name( dev )    )
+		__string( name, name ? name : ""   )
+	),
+	TP_fast_assign(
+		fpga_prog_assign_str( dev,  dev_name( dev )  );
+		fpga_prog_assign_str( name, name ? name : "" );
+	),
+	TP_printk( "%s: '%s'", __get_str( dev ), __get_str( name ) )
+);
+
+TRACE_EVENT( fpga_prog_mgr_get,
+	TP_PROTO( struct device *dev, int err ),
+	TP_ARGS( dev, err ),
+	TP_STRUCT__entry(
+		__string( dev,  dev_name( dev )    )
+		__field(  int,  err                )
+	),
+	TP_fast_assign(
+		fpga_prog_assign_str( dev,  dev_name( dev )  );
+		__entry->err = err;
+	),
+	TP_printk( "%s: err %d", __get_str( dev ), __entry->err )
+);
+
+TRACE_EVENT( fpga_prog_mgr_put,
+	TP_PROTO( struct device *dev ),
+	TP_ARGS( dev ),
+	TP_STRUCT__entry(
+		__string( dev,  dev_name( dev )    )
+	),
+	TP_fast_assign(
+		fpga_prog_assign_str( dev,  dev_name( dev )  );
+	),
+	TP_printk( "%s", __get_str( dev ) )
+);
+
+TRACE_EVENT( fpga_prog_load_start,
+	TP_PROTO( struct device *dev, size_t size ),
+	TP_ARGS( dev, size ),
+	TP_STRUCT__entry(
+		__string( dev,  dev_name( dev )    )
+		__field(  size_t, size             )
+	),
+	TP_fast_assign(
+		fpga_prog_assign_str( dev,  dev_name( dev )  );
+		__entry->size = size;
+	),
+	TP_printk( "%s: size %zu", __get_str( dev ), __entry->size )
+);
+
+TRACE_EVENT( fpga_prog_load_end,
+	TP_PROTO( struct device *dev, size_t size, int err ),
+	TP_ARGS( dev, size, err ),
+	TP_STRUCT__entry(
+		__string( dev,  dev_name( dev )    )
+		__field(  size_t, size             )
+		__field(  int,  err                )
+	),
+	TP_fast_assign(
+		fpga_prog_assign_str( dev,  dev_name( dev )  );
+		__entry->size = size;
+		__entry->err  = err;
+	),
+	TP_printk( "%s: size %zu err %d", __get_str( dev ), __entry->size, __entry->err )
+);
+
+/* 'Soft' programmer device created/released */
+TRACE_EVENT( fpga_prog_pdev_create,
+	TP_PROTO( struct device *dev ),
+	TP_ARGS( dev ),
+	TP_STRUCT__entry(
+		__string( dev,  dev_name( dev )    )
+	),
+	TP_fast_assign(
+		fpga_prog_assign_str( dev,  dev_name( dev )  );
+	),
+	TP_printk( "%s", __get_str( dev ) )
+);
+
+TRACE_EVENT( fpga_prog_pdev_release,
+	TP_PROTO( struct device *dev ),
+	TP_ARGS( dev ),
+	TP_STRUCT__entry(
+		__string( dev,  dev_name( dev )    )
+	),
+	TP_fast_assign(
+		fpga_prog_assign_str( dev,  dev_name( dev )  );
+	),
+	TP_printk( "%s", __get_str( dev ) )
+);
+
+#endif /* FPGA_PROG_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE fpga_prog_trace
+
+#include <trace/define_trace.h>
@@ -0,0 +1,124 @@
+#!/bin/sh
+# Copyright Notice
+# ================
+# This file is part of the fpga_prog linux kernel module.
+# It is subject to the license terms in the LICENSE.txt
+# file found in the top-level directory of this distribution and at
+# https://confluence.slac.stanford.edu/display/ppareg/LICENSE.html.
+#
+# No part of the software, including this file, may be copied, modified,
+# propagated, or distributed except according to the terms contained in
+# the LICENSE.txt file.
+
+# Measure programming latency and throughput of fpga_prog using the
+# mock manager (fpga_prog_mockmgr). Both modules must be loaded; a soft
+# programmer for the mock manager is created if necessary.
+#
+# Usage: fpga_prog_bench.sh [-m file|program] [-n iterations] [-s "size_kB ..."]
+#                           [-t throughput_kBps] [-d mock_device] [-k tmpdir]
+
+MODE=file
+NITER=10
+SIZES="64 1024 4096"
+TPUT=
+MOCK=fpga-prog-mock.0
+TMPD=/tmp
+
+DRV=/sys/bus/platform/drivers/fpga_programmer
+MODP=/sys/module/fpga_prog_mockmgr/parameters
+FWPATH=/sys/module/firmware_class/parameters/path
+
+while getopts "m:n:s:t:d:k:h" opt ; do
+	case $opt in
+		m) MODE="$OPTARG"  ;;
+		n) NITER="$OPTARG" ;;
+		s) SIZES="$OPTARG" ;;
+		t) TPUT="$OPTARG"  ;;
+		d) MOCK="$OPTARG"  ;;
+		k) TMPD="$OPTARG"  ;;
+		*) sed -n '/^# Usage/,/^$/s/^# \{0,1\}//p' "$0" ; exit 1 ;;
+	esac
+done
+
+case "$MODE" in
+	file|program) ;;
+	*) echo "invalid mode '$MODE'" 1>&2 ; exit 1 ;;
+esac
+
+die() {
+	echo "$*" 1>&2
+	exit 1
+}
+
+[ -d "$DRV" ]  || die "fpga_prog not loaded"
+[ -d "$MODP" ] || die "fpga_prog_mockmgr not loaded"
+
+# the programmer is named after the manager's id
+MGR=`ls /sys/bus/platform/devices/"$MOCK"/fpga_manager 2>/dev/null | head -n 1`
+[ -n "$MGR" ] || die "no fpga_manager found for '$MOCK'"
+PROG=/sys/bus/platform/devices/prog-fpga.${MGR#fpga}
+
+if [ ! -d "$PROG" ] ; then
+	echo -n "$MOCK" > "$DRV"/add_programmer || die "unable to create programmer for '$MOCK'"
+fi
+
+if [ -n "$TPUT" ] ; then
+	echo "$TPUT" > "$MODP"/throughput
+fi
+
+# absolute paths are used for images
+OLDFWPATH=`cat "$FWPATH"`
+echo -n '/' > "$FWPATH"
+echo 0 > "$PROG"/async
+echo 0 > "$PROG"/skip_identical
+echo 1 > "$PROG"/autoload
+
+cleanup() {
+	echo -n "$OLDFWPATH" > "$FWPATH"
+	rm -f "$TMPD"/fpga_prog_bench_$$.bin
+}
+trap cleanup EXIT
+
+now_ns() {
+	date +%s%N
+}
+
+printf "%-8s %-8s %6s %12s %12s %12s %10s\n" mode size_kB n min_us avg_us max_us MB/s
+
+for size in $SIZES ; do
+	IMG="$TMPD"/fpga_prog_bench_$$.bin
+	dd if=/dev/urandom of="$IMG" bs=1024 count="$size" 2>/dev/null || die "unable to create image"
+
+	if [ "$MODE" = program ] ; then
+		echo 0 > "$PROG"/autoload
+		echo -n "$IMG" > "$PROG"/file
+	fi
+
+	i=0
+	while [ $i -lt "$NITER" ] ; do
+		t0=`now_ns`
+		if [ "$MODE" = program ] ; then
+			echo force > "$PROG"/program || die "programming failed"
+		else
+			echo -n "$IMG" > "$PROG"/file || die "programming failed"
+		fi
+		t1=`now_ns`
+		echo $(( (t1 - t0) / 1000 ))
+		i=$((i + 1))
+	done | awk -v mode="$MODE" -v size="$size" '
+		{ if ( NR == 1 || $1 < min ) min = $1; if ( $1 > max ) max = $1; sum += $1 }
+		END {
+			avg = sum / NR;
+			printf "%-8s %-8d %6d %12d %12d %12d %10.2f\n", mode, size, NR, min, avg, max, size * 1024 / avg
+		}'
+
+	echo 1 > "$PROG"/autoload
+	rm -f "$IMG"
+done
+
+echo
+echo "fpga_prog stats (count last min max mean; us):"
+for f in fetch acquire load total ; do
+	printf "  %-8s %s\n" "$f" "`cat "$PROG"/stats/$f`"
+done
+echo "mock stats (loads fails last_bytes): `cat /sys/bus/platform/devices/"$MOCK"/stats`"
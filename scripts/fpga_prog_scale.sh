@@ -0,0 +1,88 @@
+#!/bin/sh
+# Copyright Notice
+# ================
+# This file is part of the fpga_prog linux kernel module.
+# It is subject to the license terms in the LICENSE.txt
+# file found in the top-level directory of this distribution and at
+# https://confluence.slac.stanford.edu/display/ppareg/LICENSE.html.
+#
+# No part of the software, including this file, may be copied, modified,
+# propagated, or distributed except according to the terms contained in
+# the LICENSE.txt file.
+
+# Measure the cost of creating and removing soft programmers as their
+# number grows. fpga_prog must be loaded; fpga_prog_mockmgr is loaded
+# (with 'num_mgrs' managers) unless it is loaded already, in which case
+# it must provide at least that many managers.
+#
+# Usage: fpga_prog_scale.sh [-n num_programmers] [-b batch] [-k fpga_prog_mockmgr.ko]
+
+NUM=256
+BATCH=64
+MOCKKO=./fpga_prog_mockmgr.ko
+
+DRV=/sys/bus/platform/drivers/fpga_programmer
+DEVS=/sys/bus/platform/devices
+
+while getopts "n:b:k:h" opt ; do
+	case $opt in
+		n) NUM="$OPTARG"    ;;
+		b) BATCH="$OPTARG"  ;;
+		k) MOCKKO="$OPTARG" ;;
+		*) sed -n '/^# Usage/,/^$/s/^# \{0,1\}//p' "$0" ; exit 1 ;;
+	esac
+done
+
+die() {
+	echo "$*" 1>&2
+	exit 1
+}
+
+[ -d "$DRV" ] || die "fpga_prog not loaded"
+
+if [ ! -d /sys/module/fpga_prog_mockmgr ] ; then
+	insmod "$MOCKKO" num_mgrs="$NUM" || die "unable to load $MOCKKO"
+fi
+
+[ -d "$DEVS"/fpga-prog-mock.$((NUM - 1)) ] || die "not enough mock managers (need $NUM)"
+
+now_ns() {
+	date +%s%N
+}
+
+# programmer (soft device) name for mock device $1
+prog_of() {
+	echo prog-fpga.`ls "$DEVS"/fpga-prog-mock.$1/fpga_manager | sed -e 's/fpga//'`
+}
+
+# run "$1 <index>" for all mock devices, report the mean time per
+# operation for each batch. This should not grow with the number of
+# programmers. Looking up a manager (by name and in fpga_mgr_get())
+# walks the fpga_manager class, i.e., the absolute cost depends on
+# 'num_mgrs'.
+run() {
+	i=0
+	tb=`now_ns`
+	while [ $i -lt "$NUM" ] ; do
+		$1 $i || die "$1 $i failed"
+		i=$((i + 1))
+		if [ $((i % BATCH)) -eq 0 ] || [ $i -eq "$NUM" ] ; then
+			t=`now_ns`
+			n=$(( (i - 1) % BATCH + 1 ))
+			printf "%-8s %8d %12d\n" "$1" $i $(( (t - tb) / 1000 / n ))
+			tb=$t
+		fi
+	done
+}
+
+add_one() {
+	echo -n fpga-prog-mock.$1 > "$DRV"/add_programmer
+}
+
+del_one() {
+	echo 1 > "$DEVS"/`prog_of $1`/remove
+}
+
+printf "%-8s %8s %12s\n" op count us/op
+run add_one
+run del_one